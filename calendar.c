@@ -0,0 +1,76 @@
+/*
+ * Calendar
+ *
+ * Created: 18/10/2026 16:40:21
+ */ 
+
+#include <stdint.h>
+#include "calendar.h"
+
+// Returns the number of days in a month. Every fourth year is a leap year
+// between 2000 and 2099.
+uint8_t calendar_days(uint8_t year, uint8_t month) {
+	if (month == 2) return year % 4 ? 28 : 29;
+	return 30 + ((month + (month >> 3)) & 1);
+}
+
+// Days since 1-1-2000 of the first day of a month
+static uint16_t calendar_first(uint8_t year, uint8_t month) {
+	uint16_t days = year * 365U + (year + 3) / 4;
+	for (uint8_t m = 1; m < month; m++) days += calendar_days(year, m);
+	return days;
+}
+
+void calendar_split(uint32_t t, datetime_t *dt) {
+	dt->sec = t % 60;
+	t /= 60;
+	dt->min = t % 60;
+	t /= 60;
+	dt->hour = t % 24;
+	uint16_t days = t / 24;
+	dt->wday = (days + 5) % 7;  // 1-1-2000 was a Saturday
+	dt->year = 0;
+	for (uint16_t length; days >= (length = dt->year % 4 ? 365 : 366); days -= length) dt->year++;
+	dt->month = 1;
+	for (uint8_t length; days >= (length = calendar_days(dt->year, dt->month)); days -= length) dt->month++;
+	dt->day = days + 1;
+}
+
+uint32_t calendar_join(const datetime_t *dt) {
+	uint16_t days = calendar_first(dt->year, dt->month) + dt->day - 1;
+	return ((days * 24UL + dt->hour) * 60 + dt->min) * 60 + dt->sec;
+}
+
+// Returns the standard time at 2:00 of a Sunday of a month, the nth or, when n
+// is zero, the last
+static uint32_t calendar_sunday(uint8_t year, uint8_t month, uint8_t n) {
+	uint16_t first = calendar_first(year, month);
+	uint8_t wday = (first + 5) % 7;
+	uint8_t day = (13 - wday) % 7 + (n ? n - 1 : 0) * 7;  // Days after the first
+	if (n == 0) while (day + 7 < calendar_days(year, month)) day += 7;
+	return (first + day) * SECS_PER_DAY + 2 * 3600UL;
+}
+
+// Returns the daylight saving offset in seconds at a standard time. The EU
+// switches on the last Sundays of March and October at 1:00 UTC, which is
+// 2:00 standard time in central Europe. The US switches on the second Sunday
+// of March at 2:00 standard time and back on the first Sunday of November at
+// 2:00 daylight time.
+uint16_t calendar_dst(uint32_t t, uint8_t rule) {
+	uint8_t year = t / (SECS_PER_DAY * 1461) * 4;  // Four year cycles
+	while (calendar_first(year + 1, 1) * SECS_PER_DAY <= t) year++;
+	uint32_t start, end;
+	switch (rule) {
+		case DST_EU:
+			start = calendar_sunday(year, 3, 0);
+			end = calendar_sunday(year, 10, 0);
+			break;
+		case DST_US:
+			start = calendar_sunday(year, 3, 2);
+			end = calendar_sunday(year, 11, 1) - 3600;
+			break;
+		default:
+			return 0;
+	}
+	return t >= start && t < end ? 3600 : 0;
+}
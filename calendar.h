@@ -0,0 +1,36 @@
+/*
+ * Calendar
+ *
+ * Conversion between a count of seconds since 1-1-2000 00:00 and calendar
+ * fields, valid up to 2099, and daylight saving time rules. The clock keeps
+ * standard time and converts only when the fields are needed.
+ *
+ * Created: 18/10/2026 16:40:03
+ */ 
+
+
+#ifndef CALENDAR_H_
+#define CALENDAR_H_
+
+#include <stdint.h>
+
+#define SECS_PER_DAY 86400UL
+#define SECS_PER_WEEK (7 * SECS_PER_DAY)
+
+// Daylight saving time rules
+enum {DST_OFF, DST_EU, DST_US, DST_RULES};
+
+typedef struct {
+	uint8_t year;   // Years since 2000
+	uint8_t month;  // 1 to 12
+	uint8_t day;    // 1 to 31
+	uint8_t hour, min, sec;
+	uint8_t wday;   // 0 is Monday
+} datetime_t;
+
+extern uint8_t calendar_days(uint8_t year, uint8_t month);
+extern void calendar_split(uint32_t t, datetime_t *dt);
+extern uint32_t calendar_join(const datetime_t *dt);
+extern uint16_t calendar_dst(uint32_t t, uint8_t rule);
+
+#endif /* CALENDAR_H_ */
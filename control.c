@@ -0,0 +1,282 @@
+/*
+ * Thermostat control
+ *
+ * Created: 18/10/2026 09:12:31
+ */ 
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "control.h"
+
+#define P_ON_M  // Proportional on measurement
+#define TUNE_HYST 2           // Relay hysteresis in tenths of a degree
+#define TUNE_MAX_SAMPLES 8192 // Give up when a period takes longer
+
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+// Channel globals
+profile_t profile[CHANNELS] = {
+	{200, 90, 10, 10, 5, 3, 3, 0, FUSE_S0, 50, 0, 0, 0, 0, 0, true, false, 0},
+	{200, 90, 10, 10, 5, 3, 3, 0, FUSE_S1_S0, 50, 0, 0, 0, 0, 0, true, false, 0}
+};
+control_t control[CHANNELS];
+
+// Relay auto-tune globals
+uint8_t tune = 0, tune_cycle;
+bool tune_relay;
+uint16_t tune_samples, tune_period;
+int16_t tune_max, tune_min, tune_amp;
+
+// Setpoint transitions
+// Returns the setpoint of a channel moving to the target at the ramp rate, in
+// elapsed time of 1/256 s. When the target changes, the feed-forward gain
+// preloads the PID accumulator with the output change the new setpoint needs,
+// which proportional on measurement would otherwise build up slowly. The
+// warm-up gains apply from then until the ramp has finished and the input is
+// within WARMUP_BAND of the target.
+int16_t control_setpoint(uint8_t ch, int16_t target, int16_t input, uint16_t elapsed) {
+	const profile_t *p = &profile[ch];
+	control_t *c = &control[ch];
+	if (!c->ready) {
+		c->ready = true;
+		c->target = target;
+		c->setpoint = (int32_t)target << 8;
+	}
+	if (target != c->target) {
+		c->outputSum += (int32_t)p->Kf * (target - c->target);
+		c->outputSum = constrain(c->outputSum, 0, DIM_STEPS * 100L);
+		c->target = target;
+		c->warmup = true;
+	}
+	int32_t goal = (int32_t)target << 8;
+	int32_t step = p->ramp ? (uint32_t)p->ramp * elapsed / 60 : INT32_MAX;
+	if (c->setpoint < goal)
+		c->setpoint = goal - c->setpoint > step ? c->setpoint + step : goal;
+	else
+		c->setpoint = c->setpoint - goal > step ? c->setpoint - step : goal;
+	if (c->setpoint == goal && input - target <= WARMUP_BAND && target - input <= WARMUP_BAND) c->warmup = false;
+	return (c->setpoint + 128) >> 8;
+}
+
+// PID control
+// Terms are summed in hundredths of a dim step using 32-bit arithmetic. The
+// gains apply to the nominal sample interval, so the integral term is scaled by
+// the elapsed time and the derivative term by its inverse, both in 1/256 of
+// the nominal interval. Ki is in thousandths, as the integral gain of a slow
+// plant is a fraction of a hundredth per sample, and Kd is 16-bit, as its
+// derivative gain is many times Kp. With errors limited to 200 degrees and a
+// ratio of at most 4 no product or sum can overflow, the derivative term is
+// divided by the ratio before it is scaled, keeping the remainder. Only the
+// accumulator and the output need to be clamped to the output range.
+uint8_t pid(uint8_t ch, int16_t input, int16_t setpoint, uint16_t elapsed, uint16_t nominal) {
+	const profile_t *p = &profile[ch];
+	control_t *c = &control[ch];
+	uint8_t kp = p->Kp, ki = p->Ki;
+	uint16_t kd = p->Kd;
+	if (c->warmup && p->wKp) {
+		kp = p->wKp;
+		ki = p->wKi;
+		kd = p->wKd;
+	}
+	int32_t output = 0;
+	int32_t error = constrain((int32_t)setpoint - input, -2000, 2000);
+	int32_t dInput = constrain((int32_t)input - c->lastInput, -2000, 2000);
+	uint16_t ratio = constrain(((uint32_t)elapsed << 8) / nominal, 64, 1024);
+	c->lastInput = input;
+	c->dInput = dInput;
+	c->outputSum += ki * error * ratio / 1280;
+#ifdef P_ON_M
+	c->outputSum -= kp * dInput;  // Proportional on Measurement
+#else
+	output = kp * error;  // Proportional on Error
+#endif
+	// Anti-windup, the accumulator never exceeds the output range
+	c->outputSum = constrain(c->outputSum, 0, DIM_STEPS * 100L);
+	ldiv_t d = ldiv(kd * dInput, ratio);
+	output += c->outputSum - (d.quot * 128 + d.rem * 128 / ratio);  // Derivative on Measurement
+	// Round to dim steps after clamping, so a 16-bit division suffices
+	return ((uint16_t)constrain(output, 0, DIM_STEPS * 100L) + 50) / 100;
+}
+
+// Sets the dim level of an automatic channel. A dimming channel follows the PID
+// output. An on/off channel with a window is time proportioned by control_tick.
+// Otherwise it is a hysteresis controller that switches on below the band
+// around the setpoint and off above it, but only after it has been on or off
+// for its minimum time, which is counted per channel in elapsed time of 1/256 s.
+void control_output(uint8_t ch, uint8_t output, int16_t input, int16_t setpoint, uint16_t elapsed) {
+	profile_t *p = &profile[ch];
+	control_t *c = &control[ch];
+	if (!p->on_off) {
+		p->dim = output;
+		return;
+	}
+	if (p->window) {
+		c->duty = output;
+		return;
+	}
+	c->lockout = c->lockout > elapsed ? c->lockout - elapsed : 0;
+	if (c->lockout) return;
+	int16_t half = p->hyst / 2;
+	if (p->dim && input > setpoint + (p->hyst - half)) {
+		c->lockout = p->min_off * 2560UL;
+		p->dim = 0;
+	} else if (!p->dim && input < setpoint - half) {
+		c->lockout = p->min_on * 2560UL;
+		p->dim = DIM_STEPS;
+	}
+}
+
+// Returns true when the input of a channel is close to its setpoint and hardly
+// changed during the last sample, so it can be sampled less often
+bool control_steady(uint8_t ch, int16_t input, int16_t setpoint) {
+	int16_t error = setpoint - input, dInput = control[ch].dInput;
+	return error >= -STEADY_BAND && error <= STEADY_BAND && dInput >= -STEADY_SLOPE && dInput <= STEADY_SLOPE;
+}
+
+// Returns the next sample interval in seconds. It doubles while all channels
+// are steady, up to ADAPT_MAX times the base interval dT, and returns to dT
+// on any disturbance. pid() scales its terms by the elapsed time, so the gains
+// need no change.
+uint8_t control_interval(uint8_t interval, uint8_t base, bool steady) {
+	uint16_t next = steady ? interval * 2 : base;
+	return next < base * ADAPT_MAX ? next : base * ADAPT_MAX;
+}
+
+// Time proportioning, called once a second from the main loop with the seconds
+// passed. A channel is fully on for duty / DIM_STEPS of each window, starting
+// at the window start.
+void control_tick(uint8_t seconds) {
+	for (uint8_t ch = 0; ch < CHANNELS; ch++) {
+		profile_t *p = &profile[ch];
+		control_t *c = &control[ch];
+		if (!p->automatic || !p->on_off || !p->window || tune == ch + 1) continue;
+		uint16_t period = p->window * 10;
+		c->second = (c->second + seconds) % period;
+		p->dim = c->second < c->duty * period / DIM_STEPS ? DIM_STEPS : 0;
+	}
+}
+
+// Relay feedback auto-tune after Astrom and Hagglund. The channel switches
+// between off and full on around the setpoint, which makes the temperature
+// oscillate. Peak-to-peak amplitude pp and period Tu are averaged over several
+// periods. With relay amplitude d = DIM_STEPS / 2 and a = pp / 2, the ultimate
+// gain is Ku = 4 * d / (pi * a). The classic Ziegler-Nichols rules Kp = 0.6 * Ku,
+// Ti = Tu / 2 and Td = Tu / 8, in the units used by pid() and with Tu counted in
+// samples of dT, become Kp = 76.4 * DIM_STEPS / pp, Ki = 10 * Kp / Tu and
+// Kd = Kp * Tu / 4. Ki and Kd follow the stored Kp. The caller stores the gains
+// when tune returns to 0. A manual channel is refused, the relay would
+// overwrite its output level. On an on/off channel the relay keeps its minimum
+// on and off times, which lengthens the period and lowers the gains.
+void tune_start(uint8_t ch) {
+	if (ch && !profile[ch - 1].automatic) return;
+	tune = ch;
+	tune_cycle = 0;
+	tune_relay = false;
+	tune_samples = tune_period = tune_amp = 0;
+}
+
+static void tune_finish(void) {
+	uint16_t pp = tune_amp / TUNE_CYCLES, tu = tune_period / TUNE_CYCLES;
+	profile_t *p = &profile[tune - 1];
+	tune = 0;
+	if (pp == 0 || tu == 0) return;
+	uint16_t kp = (DIM_STEPS * 764UL / 10) / pp;
+	p->Kp = constrain(kp, 1, 255);
+	uint16_t ki = (p->Kp * 10 + tu / 2) / tu;
+	uint32_t kd = (uint32_t)p->Kp * tu / 4;
+	p->Ki = constrain(ki, 1, 255);
+	p->Kd = kd > KD_MAX ? KD_MAX : kd;
+}
+
+// Returns the relay output for the channel being tuned, elapsed is the time
+// since the last call in 1/256 s
+uint8_t autotune(int16_t input, int16_t setpoint, uint16_t elapsed) {
+	const profile_t *p = &profile[tune - 1];
+	control_t *c = &control[tune - 1];
+	if (++tune_samples > TUNE_MAX_SAMPLES) {
+		tune = 0;  // Plant does not oscillate
+		return 0;
+	}
+	if (input > tune_max) tune_max = input;
+	if (input < tune_min) tune_min = input;
+	// The relay is held until an on/off channel has been on or off long enough
+	c->lockout = c->lockout > elapsed ? c->lockout - elapsed : 0;
+	if (!c->lockout && tune_relay && input > setpoint + TUNE_HYST) {
+		tune_relay = false;
+		if (p->on_off) c->lockout = p->min_off * 2560UL;
+	} else if (!c->lockout && !tune_relay && input < setpoint - TUNE_HYST) {
+		tune_relay = true;
+		if (p->on_off) c->lockout = p->min_on * 2560UL;
+		// Every switch on starts a period, the one before the first is incomplete
+		if (tune_cycle++) {
+			tune_period += tune_samples;
+			tune_amp += tune_max - tune_min;
+		}
+		tune_samples = 0;
+		tune_max = tune_min = input;
+		if (tune_cycle > TUNE_CYCLES) tune_finish();
+	}
+	return tune_relay ? DIM_STEPS : 0;
+}
+
+// Sensor fusion
+// Combines the sensor readings into the process value of a channel. A sensor
+// is usable while its last good reading is at most SENSOR_STALE seconds or two
+// sample intervals old, so a single failed reading is bridged at any interval.
+// Single sensor policies only use their own sensor, failover policies switch
+// to the second sensor and the combining policies use whichever sensor is
+// left. The input steps when the set of sensors changes, so the last input of
+// the PID restarts from it and neither the proportional on measurement nor
+// the derivative term kicks. Returns false when the channel has no usable
+// input.
+bool fuse(uint8_t ch, const int16_t *temperature, const uint16_t *age, uint8_t interval, int16_t *input) {
+	const profile_t *p = &profile[ch];
+	control_t *c = &control[ch];
+	uint16_t stale = interval * 2 > SENSOR_STALE ? interval * 2 : SENSOR_STALE;
+	bool ok0 = age[0] <= stale, ok1 = age[1] <= stale;
+	int16_t t0 = temperature[0], t1 = temperature[1];
+	switch (p->fusion) {
+		case FUSE_S0:
+			ok1 = false;
+			break;
+		case FUSE_S1:
+			ok0 = false;
+			break;
+		case FUSE_S0_S1:
+			if (ok0) ok1 = false;
+			break;
+		case FUSE_S1_S0:
+			if (ok1) ok0 = false;
+			break;
+	}
+	if (!ok0 && !ok1) {
+		c->sources = 0;
+		return false;
+	}
+	if (!ok1) {
+		*input = t0;
+	} else if (!ok0) {
+		*input = t1;
+	} else {
+		switch (p->fusion) {
+			case FUSE_MIN:
+				*input = t0 < t1 ? t0 : t1;
+				break;
+			case FUSE_MAX:
+				*input = t0 > t1 ? t0 : t1;
+				break;
+			case FUSE_WEIGHTED:
+				*input = ((int32_t)t0 * p->weight + (int32_t)t1 * (100 - p->weight)) / 100;
+				break;
+			default:
+				*input = ((int32_t)t0 + t1) / 2;
+		}
+	}
+	uint8_t sources = ok0 | ok1 << 1;
+	if (sources != c->sources) {
+		c->sources = sources;
+		c->lastInput = *input;
+	}
+	return true;
+}
@@ -0,0 +1,78 @@
+/*
+ * Thermostat control
+ *
+ * PID control, relay auto-tune and automatic channel output logic. This module
+ * has no hardware dependencies, so it can also be linked into a host build
+ * against a simulated thermal plant.
+ *
+ * Created: 18/10/2026 09:12:40
+ */ 
+
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DIM_STEPS 50     // Dim levels of a channel, also the PID output range
+#define TUNE_CYCLES 4    // Oscillation periods to average during auto-tune
+#define CHANNELS 2
+#define SENSORS 2
+#define SENSOR_STALE 30  // Shortest time in seconds a sensor reading stays usable after a failure
+#define WARMUP_BAND 5    // Error in tenths of a degree that ends a warm-up
+#define STEADY_BAND 3    // Error in tenths of a degree of a steady channel
+#define STEADY_SLOPE 1   // Input change in tenths of a degree per sample of a steady channel
+#define ADAPT_MAX 4      // Longest sample interval of steady channels in multiples of dT, 1 disables
+#define KD_MAX 9999      // Largest derivative gain, 99.99
+
+// Sensor fusion policies
+enum {FUSE_S0, FUSE_S1, FUSE_S0_S1, FUSE_S1_S0, FUSE_AVG, FUSE_MIN, FUSE_MAX, FUSE_WEIGHTED, FUSIONS};
+
+// Control profile of a channel, stored in EEPROM
+typedef struct {
+	int16_t base_temp;           // Setpoint outside schedule periods in tenths of a degree
+	uint8_t Kp;                  // Proportional gain in hundredths
+	uint8_t Ki;                  // Integral gain in thousandths
+	uint16_t Kd;                 // Derivative gain in hundredths
+	uint8_t hyst;                // On/off hysteresis band in tenths of a degree
+	uint8_t min_on, min_off;     // Minimum on and off time in 10 s units
+	uint8_t window;              // Time proportioning window in 10 s units, zero for hysteresis
+	uint8_t fusion;              // How the sensor readings are combined
+	uint8_t weight;              // Weight of sensor 0 in percent for FUSE_WEIGHTED
+	uint8_t wKp, wKi;            // Warm-up PID gains, not used when wKp is zero
+	uint16_t wKd;
+	uint8_t Kf;                  // Feed-forward in hundredths of a dim step per tenth of a degree
+	uint8_t ramp;                // Setpoint ramp in tenths of a degree per minute, zero for a step
+	bool automatic, on_off;      // Controlled by PID, switched instead of dimmed
+	uint8_t dim;                 // Output level in dim steps
+} profile_t;
+
+// Run time control state of a channel
+typedef struct {
+	int16_t lastInput, dInput;
+	int32_t outputSum;
+	uint32_t lockout;  // Time left before an on/off channel may switch, in 1/256 s
+	uint8_t duty;      // PID output for time proportioning
+	uint16_t second;   // Position in the time proportioning window
+	int32_t setpoint;  // Ramped setpoint in 1/256 tenths of a degree
+	int16_t target;    // Setpoint the ramp moves to
+	bool ready, warmup;
+	uint8_t sources;   // Sensors in the fused input, a bit per sensor
+} control_t;
+
+extern profile_t profile[CHANNELS];
+extern control_t control[CHANNELS];
+extern uint8_t tune, tune_cycle;  // Channel being tuned plus one, periods started
+
+extern int16_t control_setpoint(uint8_t ch, int16_t target, int16_t input, uint16_t elapsed);
+extern uint8_t pid(uint8_t ch, int16_t input, int16_t setpoint, uint16_t elapsed, uint16_t nominal);
+extern void tune_start(uint8_t ch);
+extern uint8_t autotune(int16_t input, int16_t setpoint, uint16_t elapsed);
+extern void control_output(uint8_t ch, uint8_t output, int16_t input, int16_t setpoint, uint16_t elapsed);
+extern void control_tick(uint8_t seconds);
+extern bool control_steady(uint8_t ch, int16_t input, int16_t setpoint);
+extern uint8_t control_interval(uint8_t interval, uint8_t base, bool steady);
+extern bool fuse(uint8_t ch, const int16_t *temperature, const uint16_t *age, uint8_t interval, int16_t *input);
+
+#endif /* CONTROL_H_ */
@@ -9,12 +9,13 @@
  * This is a graphical menu configurable AC dimming thermostat with two output
  * channels. Each channel be set to on/off switching. Up to two temperature
  * sensors are detected automatically. Each channel is controlled individually
- * when using two sensors. Start of daytime and length of day are used to
- * determine day and night temperatures.
+ * when using two sensors. A weekly schedule of periods with their own
+ * temperatures determines the setpoints.
  * The dimming hardware uses zero-cross detection which gives a positive edge
  * at the end of a half sine wave and a negative edge at the start of a half
  * sine wave on the ICP1 pin. The OC1x pins connect to photo-TRIACs that drive
- * the power TRIACs to control the leading edge.
+ * the power TRIACs to control the leading edge. The outputs are forced off when
+ * zero-cross edges go missing or fall outside 40-70 Hz.
  *
  *    __ + -    + - __ + - ICP1     H_  L  H   L  H_  L  H   L OC1x
  *   /  \| |    | |/  \| |          | \           | \
@@ -32,7 +33,11 @@
 #include <avr/sfr_defs.h>
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
@@ -40,65 +45,230 @@
 #include "am2320.h"
 #include "aht20.h"
 #include "i2c.h"
+#include "control.h"
+#include "schedule.h"
+#include "calendar.h"
+#include "phase.h"
 
 char buffer[15];
-uint8_t EEMEM nv_magic;
 
 // AC phase control globals
-#define DIM_STEPS 50
 uint16_t next_ocr1a = 0, next_ocr1b = 0;
-uint8_t ch0_dim = 0, ch1_dim = 0;
-bool ch0_auto = true, ch1_auto = true;
-bool ch0_on_off = false, ch1_on_off = false;
-uint8_t EEMEM nv_ch0_dim, nv_ch1_dim;
-uint8_t EEMEM nv_ch0_auto, nv_ch1_auto;
-uint8_t EEMEM nv_ch0_on_off, nv_ch1_on_off;
+#define STAGGER_MAX 5
+uint8_t stagger = 0;  // Firing offset in dim steps between channels
+
+// Zero-cross monitoring globals
+#define ZC_MIN_HALF 7143  // Shortest half cycle in Timer1 ticks (70 Hz)
+#define ZC_MAX_HALF 12500 // Longest half cycle in Timer1 ticks (40 Hz)
+#define ZC_MAX_PULSE 2500 // Longest zero-cross pulse in Timer1 ticks
+#define ZC_TIMEOUT 7      // Timer0 overflows without an edge before failsafe (12,3-14,3 ms)
+#define ZC_SETTLE 4       // Good half cycles needed before outputs are enabled
+volatile uint8_t zc_timeout = 0, zc_good = 0;
+volatile uint16_t zc_period = 0;  // Full mains cycle in Timer1 ticks
+volatile int16_t zc_asym = 0;     // Difference between consecutive half cycles
+volatile uint16_t zc_lost = 0, zc_bad = 0;
+volatile uint16_t zc_halves = 0;  // Good half cycles, free running
 
 // Button polling globals
 volatile bool blink = false;
-volatile bool button[4];
 volatile uint8_t bl_delay = 0;
 #define BL_DELAY 30
 
+// Button event globals
+enum {KEY_DOWN, KEY_UP, KEY_SELECT, KEY_BACK, KEY_NONE = 0xFF};  // Pin order
+enum {KEY_PRESS, KEY_REPEAT, KEY_LONG, KEY_RELEASE};
+#define KEY_QUEUE 8  // Events buffered, a power of two
+typedef struct {
+	uint8_t key, event;
+	uint16_t time;  // Timer0 overflows of 2,048 ms
+} key_event_t;
+volatile key_event_t key_queue[KEY_QUEUE];
+volatile uint8_t key_head = 0;  // Only written by the Timer0 ISR
+volatile uint8_t key_tail = 0;  // Only written by the menus
+
 // Time keeping globals
-uint8_t time_sec = 0, time_min = 0, time_hour = 0;
-volatile uint8_t sample_delay = 0, on_off_delay = 0;
-#define ON_OFF_DELAY 30
-uint8_t on_off_thres = 15;
-uint8_t EEMEM nv_on_off_thres;
+volatile uint32_t epoch = 0;  // Standard time in seconds since 1-1-2000
+volatile uint32_t sched_alarm = UINT32_MAX;  // Epoch of the next schedule transition
+uint8_t dst_rule = DST_OFF;
+bool clock_unset = false;  // Time lost in a power down, the schedule waits until it is set
+
+// Mains clock discipline globals
+#define REF_WINDOW 3600  // Seconds of mains cycles averaged per rate estimate
+uint8_t clock_ref = 0;   // Nominal mains frequency, zero for crystal only
+volatile uint16_t ref_stamp = 0;  // zc_halves at the last Timer2 overflow
+uint16_t ref_last = 0;
+uint32_t ref_second = 0;  // Uptime of ref_last
+uint16_t ref_seconds = 0;
+int32_t ref_error = 0;   // Half cycles gained on the crystal in this window
+bool ref_taint = false;  // Window had missing or spurious edges
+int32_t ref_rate = 0;    // Clock correction in 1/16 Timer2 ticks per window
+int32_t ref_acc = 0;     // Correction not yet applied
+int8_t ref_adjust = 0;   // Timer2 ticks to apply
+int16_t ref_total = 0;   // Timer2 ticks applied
+uint16_t ref_windows = 0, ref_rejected = 0;
+volatile uint32_t uptime = 0;  // Seconds since power up
+
+// Background oscillator calibration globals
+#define CAL_SECONDS 16   // Seconds averaged per decision
+#define CAL_DRIFT 2500   // Timer1 tick error per second, or ppm, that moves OSCCAL one step
+#define CAL_EXPECT (uint16_t)(F_CPU / 8)  // Timer1 ticks per second modulo 65536
+volatile uint16_t cal_stamp = 0;  // TCNT1 at the last Timer2 overflow
+uint16_t cal_last = 0;
+int32_t cal_error = 0;
+uint8_t cal_count = 0;
+bool cal_skip = true;   // Timer2 was moved, so the last second did not last a second
+int16_t cal_ppm = 0;    // Error of the last window
+uint16_t cal_steps = 0; // OSCCAL changes since power up
+
+// Power globals
+volatile bool redraw = true;  // Screen needs to be rendered
+uint32_t slept = 0;           // Time asleep in this second in us
+uint16_t wakeups = 0;
+uint16_t awake = 1000, wake_rate = 0;  // Awake time in 1/1000 and wakeups of the last second
+
+// Control step scheduling globals
+volatile bool sample_due = true;
+volatile uint8_t sample_tick = 0;
+volatile uint8_t sample_interval = 2;  // Seconds between control steps
+uint16_t sample_overrun = 0;
+int16_t jitter_min = 0, jitter_max = 0, jitter_last = 0;  // In 1/256 s
 
 // Sensor globals
-uint16_t humidity0, humidity1;
-int16_t temperature0, temperature1;
-uint8_t sensor0 = 0, sensor1 = 0;
+uint16_t humidity[SENSORS];
+int16_t temperature[SENSORS];  // Last good readings
+uint8_t sensor[SENSORS];  // 0 for success, 1 for no response, 2 for crc error
+uint16_t sensor_age[SENSORS] = {UINT16_MAX, UINT16_MAX};  // Seconds since the last good reading
+
+// Retained state globals
+#define CHECKPOINT 3600  // Seconds between EEPROM copies of the retained state
+#define RETAIN_SLOTS 8   // Checkpoints rotated through to spread EEPROM wear
+typedef struct {
+	uint16_t seq;  // Incremented on every checkpoint, the newest valid one wins
+	uint32_t epoch;
+	int32_t outputSum[CHANNELS];
+	int16_t lastInput[CHANNELS];
+	uint8_t dim[CHANNELS];
+	bool clock_unset;
+	uint16_t crc;  // CRC-16 of all preceding bytes
+} retain_t;
+retain_t retain __attribute__((section(".noinit")));  // Survives a warm reset
+retain_t EEMEM nv_retain[RETAIN_SLOTS];  // Checkpoints for a power up
+retain_t retain_copy;  // Last checkpoint, the source of the write-behind queue
+uint8_t retain_slot = RETAIN_SLOTS - 1;
+uint16_t checkpoint = 0;
 
 // Setting globals
-uint8_t start_min = 0, start_hour = 8, length_min = 0, length_hour = 10;
-uint8_t EEMEM nv_start_min, nv_start_hour, nv_length_min, nv_length_hour;
-int16_t min_temp = 200, max_temp = 250;
-uint16_t EEMEM nv_min_temp, nv_max_temp;
+#define CONFIG_VERSION 2  // Changes with the layout of config_t
+#define CONFIG_SLOTS 8    // Records rotated through to spread EEPROM wear
+typedef struct {
+	uint8_t version;
+	uint16_t seq;  // Incremented on every write, the newest valid record wins
+	profile_t profile[CHANNELS];
+	uint8_t dT, bl_mode, contrast, stagger, dst_rule, clock_ref;
+	uint16_t crc;  // CRC-16 of all preceding bytes
+} config_t;
+config_t EEMEM nv_config[CONFIG_SLOTS];
+config_t config;  // Current record, also the source of the write-behind queue
+uint8_t config_slot = CONFIG_SLOTS - 1;  // Slot holding the current record
+
+// EEPROM write-behind queue globals
+const uint8_t *ee_src;  // Record being written
+uint16_t ee_dst;        // EEPROM address of the record
+volatile uint8_t ee_index = 0, ee_size = 0;  // Next byte to write, idle when equal
+uint8_t ee_paused = 0;  // Nesting of direct EEPROM accesses that hold the queue off
+volatile bool config_pending = false, retain_pending = false, sched_pending = false;  // Records waiting for the queue
 
 // Menu globals
-enum {HOME, SETUP, CHANNEL, KVAL, ETC};
+enum {HOME, SETUP, CHANNEL, KVAL, ETC, DIAG, RAMP, SWITCH, SCHEDULE};
 const char str_auto[] PROGMEM = "Auto";
 const char str_on_off[] PROGMEM = "On/Off";
 const char str_dimming[] PROGMEM = "Dimming";
 const char str_buttons[] PROGMEM = "Back Sel Up Dn";
+const char str_days[][4] PROGMEM = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
+const char str_dst[][4] PROGMEM = {"Off", "EU ", "US "};
+const char str_fusion[][6] PROGMEM = {"S0", "S1", "S0>S1", "S1>S0", "Avg", "Min", "Max"};
+#define INPUTS (FUSE_WEIGHTED + 9)  // Weighted input in steps of 10%
+uint8_t edit_ch = 0;  // Channel shown on the setup, channel and PID screens
 
 // PID control globals
-#define P_ON_M
-uint8_t Kp = 90, Ki = 1, Kd = 10, dT = 2;
-uint8_t EEMEM nvKp, nvKi, nvKd, nvdT;
+uint8_t dT = 2;
 
 // LCD globals
 enum {OFF, ON, AUTO};
 uint8_t bl_mode = AUTO, contrast = 60;
-uint8_t EEMEM nv_bl_mode, nv_contrast;
 uint8_t new_ocr0a = 0;
 
 // Function macros
 #define button_init() PORTC |= _BV(PC0) | _BV(PC1) | _BV(PC2) | _BV(PC3)
-#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+// ISR latency and run time statistics in Timer1 ticks (1 us)
+//#define ISR_STATS
+#ifdef ISR_STATS
+enum {STAT_CAPT, STAT_COMPA, STAT_COMPB, STAT_TC0, STAT_TC2, STAT_COUNT};
+const char isr_names[STAT_COUNT][5] PROGMEM = {"Capt", "CmpA", "CmpB", "Tc0", "Tc2"};
+typedef struct {
+	uint16_t lat_min, lat_max;
+	uint16_t run_min, run_max;
+	uint16_t hist[8];  // Latency histogram, bucket n counts latencies below 2^n us
+} isr_stat_t;
+isr_stat_t isr_stat[STAT_COUNT];
+
+static void isr_stat_clear(void) {
+	memset(isr_stat, 0, sizeof(isr_stat));
+	for (uint8_t i = 0; i < STAT_COUNT; i++)
+		isr_stat[i].lat_min = isr_stat[i].run_min = 0xFFFF;
+}
+
+static void isr_stat_update(uint8_t id, uint16_t latency, uint16_t run) {
+	isr_stat_t *stat = &isr_stat[id];
+	if (latency < stat->lat_min) stat->lat_min = latency;
+	if (latency > stat->lat_max) stat->lat_max = latency;
+	if (run < stat->run_min) stat->run_min = run;
+	if (run > stat->run_max) stat->run_max = run;
+	uint8_t bucket = 0;
+	while (latency && bucket < 7) {
+		latency >>= 1;
+		bucket++;
+	}
+	if (++stat->hist[bucket] == 0) stat->hist[bucket]--;
+}
+
+// Latency is the delay between the hardware event and the first ISR statement
+#define ISR_STAT_BEGIN(latency) uint16_t stat_tcnt1 = TCNT1, stat_latency = (latency)
+#define ISR_STAT_END(id) isr_stat_update(id, stat_latency, TCNT1 - stat_tcnt1)
+#else
+#define ISR_STAT_BEGIN(latency)
+#define ISR_STAT_END(id)
+#endif
+
+// Simulation probes, each bit of GPIOR0 is high while a code section runs and
+// GPIOR1 holds the screen being rendered. "make simavr" builds with them, and
+// sim/avr_bench reports the cycle count of every section from them. The VCD
+// trace below is also written when the firmware runs under simavr.
+//#define SIMAVR
+#ifdef SIMAVR
+#include "avr_mcu_section.h"
+enum {PROBE_LOOP, PROBE_RENDER, PROBE_SENSOR, PROBE_CONTROL, PROBE_CAPT, PROBE_COMP, PROBE_TC0, PROBE_TC2};
+AVR_MCU(F_CPU, "atmega328p");
+AVR_MCU_VCD_FILE("thermostat.vcd", 1000);
+const struct avr_mmcu_vcd_trace_t probe_trace[] _MMCU_ = {
+	{ AVR_MCU_VCD_SYMBOL("LOOP"), .mask = _BV(PROBE_LOOP), .what = (void*)&GPIOR0, },
+	{ AVR_MCU_VCD_SYMBOL("RENDER"), .mask = _BV(PROBE_RENDER), .what = (void*)&GPIOR0, },
+	{ AVR_MCU_VCD_SYMBOL("SENSOR"), .mask = _BV(PROBE_SENSOR), .what = (void*)&GPIOR0, },
+	{ AVR_MCU_VCD_SYMBOL("CONTROL"), .mask = _BV(PROBE_CONTROL), .what = (void*)&GPIOR0, },
+	{ AVR_MCU_VCD_SYMBOL("CAPT"), .mask = _BV(PROBE_CAPT), .what = (void*)&GPIOR0, },
+	{ AVR_MCU_VCD_SYMBOL("COMP"), .mask = _BV(PROBE_COMP), .what = (void*)&GPIOR0, },
+	{ AVR_MCU_VCD_SYMBOL("TC0"), .mask = _BV(PROBE_TC0), .what = (void*)&GPIOR0, },
+	{ AVR_MCU_VCD_SYMBOL("TC2"), .mask = _BV(PROBE_TC2), .what = (void*)&GPIOR0, },
+};
+#define PROBE_ON(bit) GPIOR0 |= _BV(bit)   // Compiles to a single sbi
+#define PROBE_OFF(bit) GPIOR0 &= ~_BV(bit) // Compiles to a single cbi
+#define PROBE_VIEW(view) GPIOR1 = view
+#else
+#define PROBE_ON(bit)
+#define PROBE_OFF(bit)
+#define PROBE_VIEW(view)
+#endif
 
 // Button polling and LED control
 static void timer0_init(void) {
@@ -109,10 +279,29 @@ static void timer0_init(void) {
 	OCR0A = 255;          // Maximum intensity
 }
 
+// Adds a button event to the queue, or drops it when the queue is full
+static void key_put(uint8_t key, uint8_t event, uint16_t time) {
+	uint8_t head = key_head;
+	if ((uint8_t)(head - key_tail) >= KEY_QUEUE) return;
+	volatile key_event_t *e = &key_queue[head % KEY_QUEUE];
+	e->key = key;
+	e->event = event;
+	e->time = time;
+	key_head = head + 1;
+	redraw = true;
+}
+
 ISR(TIMER0_OVF_vect) {
-	static uint8_t count = 0, push[4];  // These overflow every 524 ms
-	static bool hold[4];
-	if (++count == 0) blink = !blink;
+	PROBE_ON(PROBE_TC0);
+	ISR_STAT_BEGIN(TCNT0 * 8);  // Prescaler /64 counts 8 us per tick
+	static uint16_t count = 0;
+	static uint8_t push[4];  // Overflows a button is down, wraps after 524 ms
+	static bool hold[4];     // Held past the long press
+	static bool mute[4];     // Press that only woke the backlight, sends no events
+	if ((uint8_t)++count == 0) {
+		blink = !blink;
+		redraw = true;
+	}
 	// Fade to new intensity
 	uint8_t cur_ocr0a = OCR0A;
 	if (cur_ocr0a > new_ocr0a) cur_ocr0a--;
@@ -123,18 +312,34 @@ ISR(TIMER0_OVF_vect) {
 	// Button polling
 	for (uint8_t pin = PC0; pin < PC4; pin++) {
 		if bit_is_clear(PINC, pin) {
-			push[pin]++;
-			if (push[pin] == 0) hold[pin] = true;
+			// Signal button push after 20,5 ms, a long push once after 524 ms
+			// and then a repeat every 262 ms
+			if (++push[pin] == 10) {
+				mute[pin] = !bl_delay && bl_mode == AUTO;
+				if (!mute[pin]) key_put(pin, KEY_PRESS, count);
+				bl_delay = BL_DELAY;
+				redraw = true;
+			} else if (push[pin] == 0) {
+				if (!mute[pin]) key_put(pin, hold[pin] ? KEY_REPEAT : KEY_LONG, count);
+				hold[pin] = true;
+				push[pin] = 128;
+				bl_delay = BL_DELAY;
+				redraw = true;
+			}
 		} else {
+			if (push[pin] >= 10 && !mute[pin]) key_put(pin, KEY_RELEASE, count);
 			push[pin] = 0;
 			hold[pin] = false;
-		}
-		// Signal button push after 20,5 ms or every 262 ms when pushed longer then 524 ms
-		if (push[pin] == 10 || (hold[pin] && push[pin] == 138)) {
-			if (bl_delay || bl_mode != AUTO) button[pin] = true;
-			bl_delay = BL_DELAY;
 		}
+	}
+	// Zero-cross watchdog
+	if (zc_timeout && --zc_timeout == 0) {
+		TCCR1A = 0;  // Force outputs off
+		zc_good = 0;
+		if (zc_lost < 9999) zc_lost++;
 	}
+	ISR_STAT_END(STAT_TC0);
+	PROBE_OFF(PROBE_TC0);
 }
 
 // Time keeping
@@ -148,48 +353,177 @@ static void timer2_init(void) {
 }
 
 ISR(TIMER2_OVF_vect) {
+	PROBE_ON(PROBE_TC2);
+	ISR_STAT_BEGIN(0);  // Asynchronous clock gives no usable reference
 	// Time keeping
-	if (++time_sec > 59) {
-		time_sec = 0;
-		if (++time_min > 59) {
-			time_min = 0;
-			if (++time_hour > 23) time_hour = 0;
-		}
-	}
+	cal_stamp = TCNT1;
+	ref_stamp = zc_halves;
+	if (++epoch == sched_alarm) sched_due = true;
+	redraw = true;  // Clock display
+	uptime++;
+	// Schedule a control step every sample interval
+	if (++sample_tick >= sample_interval) {
+		sample_tick = 0;
+		if (sample_due && sample_overrun < 9999) sample_overrun++;
+		sample_due = true;
+	}
 	// Decrement counters
 	if (bl_delay) bl_delay--;
-	if (sample_delay) sample_delay--;
-	if (on_off_delay) on_off_delay--;
+	ISR_STAT_END(STAT_TC2);
+	PROBE_OFF(PROBE_TC2);
+}
+
+// Returns the time since power up in 1/256 s
+static uint32_t timestamp(void) {
+	uint32_t sec;
+	uint8_t frac;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sec = uptime;
+		frac = TCNT2;
+		// Account for an overflow that is not serviced yet
+		if (bit_is_set(TIFR2, TOV2)) {
+			frac = TCNT2;
+			sec++;
+		}
+	}
+	return (sec << 8) | frac;
 }
 
 // Internal R/C oscilator calibration
+// Oscillator calibration globals
+#define CAL_TARGET ((F_CPU / 32768) * 256)  // CPU cycles in 256 crystal periods
+#define CAL_TOLERANCE 128
+uint8_t EEMEM nv_osccal;
+
+// Returns the CPU cycles counted by Timer1 during 256 periods of the crystal,
+// or 0xFFFF when Timer1 overflowed
+static uint16_t calibrate_measure(void) {
+	// Clear interrupt flags
+	TIFR1 = TIFR2 = 0xFF;
+	// Reset timers
+	TCNT1 = TCNT2 = 0;
+	while (ASSR & (_BV(OCR2AUB) | _BV(TCN2UB) | _BV(TCR2AUB)));
+	// Start Timer/Counter1
+	TCCR1B = _BV(CS10);
+	// Stop timer on compare match
+	loop_until_bit_is_set(TIFR2, OCF2A);
+	TCCR1B = 0;
+	return bit_is_set(TIFR1, TOV1) ? 0xFFFF : TCNT1;
+}
+
+// Moves OSCCAL one step at a time, as larger changes can upset the CPU
+static void calibrate_set(uint8_t osccal) {
+	while (OSCCAL != osccal) {
+		OSCCAL += OSCCAL < osccal ? 1 : -1;
+		_NOP();
+	}
+}
+
+// Starts from the last good value in EEPROM, which usually still measures in
+// range. Otherwise a binary search over the 7-bit range of the factory value
+// finds the closest setting in 7 measurements.
 static void calibrate(void) {
-	uint8_t cycles = 128;
 	ASSR |= _BV(AS2);
 	TCCR2B = _BV(CS20);  // Enable TC2 without prescaler
 	while (ASSR & (_BV(OCR2AUB) | _BV(TCN2UB) | _BV(TCR2AUB)));
-	do {
-		// Clear interrupt flags
-		TIFR1 = TIFR2 = 0xFF;
-		// Reset timers
-		TCNT1 = TCNT2 = 0;
-		while (ASSR & (_BV(OCR2AUB) | _BV(TCN2UB) | _BV(TCR2AUB)));
-		// Start Timer/Counter1
-		TCCR1B = _BV(CS10);
-		// Stop timer on compare match
-		loop_until_bit_is_set(TIFR2, OCF2A);
-		TCCR1B = 0;
-		// Adjust calibration value
-		if (TCNT1 > (F_CPU / 32768) * 256 + 128 || bit_is_set(TIFR1, TOV1)) {
-			OSCCAL--;
-			_NOP();
-		} else if (TCNT1 < (F_CPU / 32768) * 256 - 128) {
-			OSCCAL++;
-			_NOP();
-		} else
-			break;
-	} while(--cycles);
+	uint8_t range = OSCCAL & 0x80;  // The two ranges overlap, so stay in one
+	uint8_t stored = eeprom_read_byte(&nv_osccal);
+	if ((stored & 0x80) == range) {
+		calibrate_set(stored);
+		uint16_t cycles = calibrate_measure();
+		if (cycles > CAL_TARGET - CAL_TOLERANCE && cycles < CAL_TARGET + CAL_TOLERANCE) return;
+	}
+	uint8_t low = 0, high = 0x7F;
+	while (low < high) {
+		uint8_t mid = (low + high) / 2;
+		calibrate_set(range | mid);
+		if (calibrate_measure() < CAL_TARGET)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	// The first setting at or above the target, or the one below it
+	calibrate_set(range | low);
+	uint16_t above = calibrate_measure();
+	if (low && above > CAL_TARGET) {
+		calibrate_set(range | (low - 1));
+		uint16_t below = calibrate_measure();
+		if (below > CAL_TARGET || CAL_TARGET - below > above - CAL_TARGET) calibrate_set(range | low);
+	}
+	eeprom_update_byte(&nv_osccal, OSCCAL);
+}
+
+// Compares Timer1 against the crystal, using the Timer1 count that the Timer2
+// ISR saves every second, and moves OSCCAL one step when the average error
+// over a window exceeds the drift limit. Timer1 keeps running, so phase control
+// and timekeeping are not disturbed. Seconds during which Timer2 was moved
+// by the clock discipline are skipped.
+static void calibrate_track(uint8_t seconds) {
+	uint16_t stamp;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		stamp = cal_stamp;
+	}
+	int16_t error = stamp - cal_last - seconds * CAL_EXPECT;
+	cal_last = stamp;
+	if (cal_skip || seconds > 1) {
+		cal_skip = false;
+		return;
+	}
+	cal_error += error;
+	if (++cal_count < CAL_SECONDS) return;
+	cal_ppm = cal_error / CAL_SECONDS;
+	cal_error = cal_count = 0;
+	uint8_t osccal = OSCCAL;
+	if (cal_ppm > CAL_DRIFT && (osccal & 0x7F) > 0x00) {
+		OSCCAL = osccal - 1;  // CPU runs fast
+	} else if (cal_ppm < -CAL_DRIFT && (osccal & 0x7F) < 0x7F) {
+		OSCCAL = osccal + 1;  // CPU runs slow
+	} else {
+		return;
+	}
+	cal_steps++;
+	cal_skip = true;  // The second in progress mixes both settings
+}
+
+// Phase control timing check. Every programmed firing is compared one half
+// cycle later against the ideal angle between the two measured zero crossings.
+// The capture ISR only hands the firings and crossings over, the division is
+// done in the main loop so the compare ISRs being checked are not delayed.
+//#define PHASE_CHECK
+#ifdef PHASE_CHECK
+typedef struct {
+	uint16_t fire, gate;
+	uint8_t dim;
+} phase_t;
+typedef struct {
+	phase_t firing[CHANNELS];
+	uint16_t start, end;  // Zero crossings around the half cycle
+} phase_sample_t;
+volatile phase_sample_t phase_sample;
+volatile bool phase_ready = false;  // Set by the capture ISR, cleared once checked
+uint16_t phase_error[DIM_STEPS + 1];  // Largest firing angle error per dim level in us
+uint16_t phase_gate[DIM_STEPS + 1];  // Last gate pulse width per dim level in us
+int16_t phase_tail = 0;  // Gate end minus zero crossing when fully on
+
+static void phase_check(const phase_t *p, uint16_t start, uint16_t end) {
+	uint8_t dim = p->dim;
+	if (dim == 0) return;
+	uint16_t ideal = start + (uint32_t)(end - start) * (DIM_STEPS - dim) / DIM_STEPS;
+	uint16_t error = abs((int16_t)(p->fire - ideal));
+	if (error > phase_error[dim]) phase_error[dim] = error;
+	phase_gate[dim] = p->gate;
+	if (dim == DIM_STEPS) phase_tail = p->fire + p->gate - end;
+}
+
+// Checks the half cycle handed over by the capture ISR, which leaves the
+// sample alone until phase_ready is cleared
+static void phase_check_sample(void) {
+	if (!phase_ready) return;
+	phase_sample_t s = *(phase_sample_t *)&phase_sample;
+	phase_ready = false;
+	for (uint8_t i = 0; i < CHANNELS; i++) phase_check(&s.firing[i], s.start, s.end);
 }
+#endif
 
 // AC phase control
 static void timer1_init(void) {
@@ -204,35 +538,107 @@ static void timer1_init(void) {
 }
 
 ISR(TIMER1_CAPT_vect) {
-	static uint16_t last_icr1 = 0, half_zero = 0, dim_period = 0;
+	PROBE_ON(PROBE_CAPT);
+	static uint16_t last_icr1 = 0, last_rise = 0, last_half = 0, half_zero = 0;
+	static uint8_t halves = 0;  // Half cycles fired, bit 1 gives the lead
+#ifdef PHASE_CHECK
+	static phase_t phase_cur[2], phase_prev[2];
+	static uint16_t phase_cross = 0;
+#endif
+	uint16_t icr1 = ICR1;
+	ISR_STAT_BEGIN(stat_tcnt1 - icr1);
+	zc_timeout = ZC_TIMEOUT;
 	if bit_is_set(TCCR1B, ICES1) { // Positive edge: end of half sine
-		dim_period = (ICR1 - last_icr1) / DIM_STEPS;
-		uint16_t crossing = ICR1 + half_zero;
-		// Determine when the TRIACs are to be triggered
-		OCR1A = crossing + dim_period * (DIM_STEPS - ch0_dim);
-		OCR1B = crossing + dim_period * (DIM_STEPS - ch1_dim);
-		next_ocr1a = dim_period * ch0_dim;
-		if (ch0_dim == DIM_STEPS) next_ocr1a += half_zero;
-		next_ocr1b = dim_period * ch1_dim;
-		if (ch1_dim == DIM_STEPS) next_ocr1b += half_zero;
-		// Set OC1x on compare match, only if enabled
-		TCCR1A = (ch0_dim ? _BV(COM1A0) | _BV(COM1A1) : 0) | (ch1_dim ? _BV(COM1B0) | _BV(COM1B1) : 0);
-		TIFR1 = 0xFF; // Clear interrupt flags
+		uint16_t half = icr1 - last_rise;
+		last_rise = icr1;
+		if (half < ZC_MIN_HALF || half > ZC_MAX_HALF) {
+			// Missing or spurious edge, keep outputs off until mains settles
+			TCCR1A = 0;
+			zc_good = 0;
+			if (zc_bad < 9999) zc_bad++;
+		} else {
+			if (zc_good) {
+				zc_period = half + last_half;
+				zc_asym = half - last_half;
+			}
+			last_half = half;
+			if (zc_good < ZC_SETTLE) zc_good++;
+			zc_halves++;
+		}
+#ifdef PHASE_CHECK
+		phase_prev[0] = phase_cur[0];
+		phase_prev[1] = phase_cur[1];
+		phase_cur[0].dim = phase_cur[1].dim = 0;
+#endif
+		if (zc_good == ZC_SETTLE) {
+			firing_t f;
+			uint8_t dim0 = profile[0].dim, dim1 = profile[1].dim;
+			// Determine when the TRIACs are to be triggered, the lead alternates
+			// every full cycle
+			halves++;
+			phase_plan(&f, icr1, last_icr1, half_zero, dim0, dim1, stagger, halves & 2);
+			OCR1A = f.fire[0];
+			OCR1B = f.fire[1];
+			next_ocr1a = f.gate[0];
+			next_ocr1b = f.gate[1];
+#ifdef PHASE_CHECK
+			// Check the angle without the deliberate stagger offset
+			firing_t ideal;
+			phase_plan(&ideal, icr1, last_icr1, half_zero, dim0, dim1, 0, false);
+			phase_cur[0] = (phase_t){ideal.fire[0], f.gate[0], dim0};
+			phase_cur[1] = (phase_t){ideal.fire[1], f.gate[1], dim1};
+#endif
+			// Set OC1x on compare match, only if enabled
+			TCCR1A = (dim0 ? _BV(COM1A0) | _BV(COM1A1) : 0) | (dim1 ? _BV(COM1B0) | _BV(COM1B1) : 0);
+			TIFR1 = 0xFF; // Clear interrupt flags
+		}
 	} else { // Negative edge: begin of half sine
-		half_zero = (ICR1 - last_icr1) / 2;
+		uint16_t pulse = icr1 - last_icr1;
+		if (pulse > ZC_MAX_PULSE) {
+			// Edge polarity is out of step, this was the end of a half sine
+			TCCR1A = 0;
+			zc_good = 0;
+			if (zc_bad < 9999) zc_bad++;
+			last_rise = icr1;
+			TCCR1B ^= _BV(ICES1); // Wait for the negative edge again
+		} else {
+			half_zero = pulse / 2;
+#ifdef PHASE_CHECK
+			// The half sine programmed a half cycle ago ends at this crossing
+			uint16_t cross = last_icr1 + half_zero;
+			if (zc_good == ZC_SETTLE && !phase_ready) {
+				phase_sample.firing[0] = phase_prev[0];
+				phase_sample.firing[1] = phase_prev[1];
+				phase_sample.start = phase_cross;
+				phase_sample.end = cross;
+				phase_ready = true;
+			}
+			phase_cross = cross;
+#endif
+		}
 	}
 	TCCR1B ^= _BV(ICES1); // Toggle edge trigger
-	last_icr1 = ICR1;
+	last_icr1 = icr1;
+	ISR_STAT_END(STAT_CAPT);
+	PROBE_OFF(PROBE_CAPT);
 }
 
 ISR(TIMER1_COMPA_vect) {
+	PROBE_ON(PROBE_COMP);
+	ISR_STAT_BEGIN(stat_tcnt1 - OCR1A);
 	TCCR1A &= ~_BV(COM1A0); // Clear OC1A on compare match
 	OCR1A += next_ocr1a;
+	ISR_STAT_END(STAT_COMPA);
+	PROBE_OFF(PROBE_COMP);
 }
 
 ISR(TIMER1_COMPB_vect) {
+	PROBE_ON(PROBE_COMP);
+	ISR_STAT_BEGIN(stat_tcnt1 - OCR1B);
 	TCCR1A &= ~_BV(COM1B0); // Clear OC1B on compare match
 	OCR1B += next_ocr1b;
+	ISR_STAT_END(STAT_COMPB);
+	PROBE_OFF(PROBE_COMP);
 }
 
 // Convert (scaled) integer to (zero filled) string
@@ -250,54 +656,368 @@ static char *itostr(int16_t num, char *str, uint8_t decimal, uint8_t padding) {
 	return strrev(str);
 }
 
-static bool is_daytime(void) {
-	uint16_t now = time_hour * 60 + time_min;
-	uint16_t start = start_hour * 60 + start_min;
-	return now >= start && now < start + length_hour * 60 + length_min;
+// Returns the local time in seconds since 1-1-2000
+static uint32_t clock_local(void) {
+	uint32_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now = epoch;
+	}
+	return now + calendar_dst(now, dst_rule);
 }
 
-// Home screen
-static uint8_t home(void) {
-	for (uint8_t i = 0; i < 4; i++) {
-		if (button[i]) {
-			button[i] = false;
-			return 4 - i;
+// Sets the clock to a local time, limiting the day to the month
+static void clock_set(datetime_t *dt) {
+	uint8_t days = calendar_days(dt->year, dt->month);
+	if (dt->day > days) dt->day = days;
+	uint32_t t = calendar_join(dt);
+	t -= calendar_dst(t, dst_rule);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		epoch = t;
+	}
+	clock_unset = false;
+}
+
+// Disciplines the clock against the mains frequency. Every second the good half
+// cycles are compared with the nominal count. Over a window the surplus gives
+// the crystal error, which is smoothed over windows and spread over the
+// following seconds as single Timer2 ticks of 1/256 s. Windows with missing or
+// spurious edges are rejected.
+static void clock_discipline(void) {
+	uint16_t stamp;
+	uint32_t second;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		stamp = ref_stamp;
+		second = uptime;
+	}
+	// Half cycles between Timer2 overflows, however late the main loop reads them
+	uint8_t seconds = second - ref_second;
+	uint16_t halves = stamp - ref_last;
+	ref_second = second;
+	ref_last = stamp;
+	if (!clock_ref || !seconds) return;
+	int16_t diff = halves - clock_ref * 2 * seconds;
+	if (diff < -2 * seconds || diff > 2 * seconds) ref_taint = true;
+	ref_error += diff;
+	ref_seconds += seconds;
+	ref_acc += ref_rate * seconds;
+	for (; ref_acc >= REF_WINDOW * 16L; ref_acc -= REF_WINDOW * 16L) ref_adjust++;
+	for (; ref_acc <= -REF_WINDOW * 16L; ref_acc += REF_WINDOW * 16L) ref_adjust--;
+	if (ref_seconds >= REF_WINDOW) {
+		if (ref_taint) {
+			if (ref_rejected < 9999) ref_rejected++;
+		} else {
+			// A half cycle is 256 / (2 * clock_ref) ticks
+			int32_t rate = ref_error * 128 * 16 / clock_ref;
+			ref_rate = ref_windows ? (3 * ref_rate + rate) / 4 : rate;
+			if (ref_windows < 9999) ref_windows++;
+		}
+		ref_seconds = ref_error = 0;
+		ref_taint = false;
+	}
+}
+
+// Moves Timer2 by one tick for a pending correction, away from its overflow
+static void clock_adjust(void) {
+	if (ASSR & _BV(TCN2UB)) return;  // Previous write not done yet
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t tcnt2 = TCNT2;
+		if (tcnt2 >= 1 && tcnt2 < 250) {
+			cal_skip = true;
+			if (ref_adjust > 0) {
+				TCNT2 = tcnt2 + 1;
+				ref_adjust--;
+				ref_total++;
+			} else {
+				TCNT2 = tcnt2 - 1;
+				ref_adjust++;
+				ref_total--;
+			}
+		}
+	}
+}
+
+static uint16_t crc16(const void *data, uint8_t size) {
+	const uint8_t *p = data;
+	uint16_t crc = 0xFFFF;
+	while (size--) crc = _crc16_update(crc, *p++);
+	return crc;
+}
+
+#define config_crc(c) crc16(c, offsetof(config_t, crc))
+#define retain_crc(r) crc16(r, offsetof(retain_t, crc))
+
+// Makes the next pending record current, settings first, then the schedule
+// period. Returns false when nothing is pending. Called with interrupts off.
+static bool eeprom_start(void) {
+	if (config_pending) {
+		config_pending = false;
+		ee_src = (const uint8_t *)&config;
+		ee_dst = (uint16_t)&nv_config[config_slot];
+		ee_size = sizeof(config_t);
+	} else if (sched_pending) {
+		sched_pending = false;
+		ee_src = (const uint8_t *)&sched_copy;
+		ee_dst = (uint16_t)&nv_sched[sched_slot];
+		ee_size = sizeof(period_t);
+	} else if (retain_pending) {
+		retain_pending = false;
+		ee_src = (const uint8_t *)&retain_copy;
+		ee_dst = (uint16_t)&nv_retain[retain_slot];
+		ee_size = sizeof(retain_t);
+	} else {
+		return false;
+	}
+	ee_index = 0;
+	return true;
+}
+
+// Writes the current record one byte per interrupt, skipping unchanged bytes,
+// and goes on with the next pending record when it is complete
+ISR(EE_READY_vect) {
+	if (ee_index == ee_size && !eeprom_start()) {
+		EECR &= ~_BV(EERIE);
+		return;
+	}
+	EEAR = ee_dst + ee_index;
+	uint8_t data = ee_src[ee_index++];
+	EECR |= _BV(EERE);
+	if (EEDR != data) {
+		EEDR = data;
+		EECR |= _BV(EEMPE);
+		EECR |= _BV(EEPE);
+	}
+}
+
+// Holds the queue off the EEPROM registers while other data is accessed
+static void eeprom_pause(void) {
+	ee_paused++;
+	EECR &= ~_BV(EERIE);
+	while (EECR & _BV(EEPE));
+}
+
+// Returns true while a record is being written from src
+static bool eeprom_writing(const void *src) {
+	return ee_src == src && ee_index < ee_size;
+}
+
+// Starts the queue when a record is pending, unless it is paused
+static void eeprom_next(void) {
+	if (ee_paused) return;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (ee_index < ee_size || eeprom_start()) EECR |= _BV(EERIE);
+	}
+}
+
+static void eeprom_resume(void) {
+	ee_paused--;
+	eeprom_next();
+}
+
+// Queues the settings as a new record for the next slot, unless nothing changed.
+// A write torn by a power loss fails its CRC and the previous record is used.
+static void eeprom_save(void) {
+	config_t c;
+	c.version = CONFIG_VERSION;
+	c.seq = config.seq;
+	memcpy(c.profile, profile, sizeof(profile));
+	for (uint8_t i = 0; i < CHANNELS; i++) {
+		if (c.profile[i].automatic) c.profile[i].dim = 0;  // Live PID output, not a setting
+	}
+	c.dT = dT;
+	c.bl_mode = bl_mode;
+	c.contrast = contrast;
+	c.stagger = stagger;
+	c.dst_rule = dst_rule;
+	c.clock_ref = clock_ref;
+	c.crc = config_crc(&c);
+	if (memcmp(&c, &config, sizeof(c)) == 0) return;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		// A record still waiting or being written keeps its slot
+		bool writing = eeprom_writing(&config);
+		if (!writing && !config_pending) {
+			c.seq++;
+			c.crc = config_crc(&c);
+			if (++config_slot == CONFIG_SLOTS) config_slot = 0;
+		}
+		config = c;
+		if (writing) {
+			ee_index = 0;  // Restart
+		} else {
+			config_pending = true;
 		}
 	}
+	eeprom_next();
+}
+
+// Queues a changed schedule period. Only the last edited period is held in
+// RAM, so a change to another period is dropped while the previous one still
+// waits or is being written, which takes at most 30 ms. The schedule screen
+// then shows the stored period.
+static void sched_save(uint8_t n, const period_t *period) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		bool writing = eeprom_writing(&sched_copy);
+		if (n == sched_slot || (!writing && !sched_pending)) {
+			sched_slot = n;
+			sched_copy = *period;
+			if (writing) {
+				ee_index = 0;  // Restart
+			} else {
+				sched_pending = true;
+			}
+		}
+	}
+	eeprom_next();
+}
+
+// Copies the clock and the control state to the retained record every second,
+// and queues it for the next EEPROM slot once per CHECKPOINT
+static void retain_save(uint16_t seconds) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		retain.epoch = epoch;
+	}
+	retain.clock_unset = clock_unset;
+	for (uint8_t i = 0; i < CHANNELS; i++) {
+		retain.outputSum[i] = control[i].outputSum;
+		retain.lastInput[i] = control[i].lastInput;
+		retain.dim[i] = profile[i].dim;
+	}
+	retain.crc = retain_crc(&retain);
+	checkpoint += seconds;
+	if (checkpoint >= CHECKPOINT && !retain_pending && !eeprom_writing(&retain_copy)) {
+		checkpoint = 0;
+		uint16_t seq = retain_copy.seq + 1;
+		retain_copy = retain;
+		retain_copy.seq = seq;
+		retain_copy.crc = retain_crc(&retain_copy);
+		if (++retain_slot == RETAIN_SLOTS) retain_slot = 0;
+		retain_pending = true;
+		eeprom_next();
+	}
+}
+
+// Resumes the clock and the control state after a reset. A warm reset keeps
+// the record in RAM, including whether the clock was set. After a power up the
+// newest checkpoint is used instead, but its time is old, so the clock is
+// flagged as unset.
+static void retain_init(void) {
+	uint8_t reset = MCUSR;
+	MCUSR = 0;
+	retain_t r;
+	bool found = false;
+	for (uint8_t i = 0; i < RETAIN_SLOTS; i++) {
+		eeprom_read_block(&r, &nv_retain[i], sizeof(retain_t));
+		if (r.crc != retain_crc(&r)) continue;
+		if (found && (int16_t)(r.seq - retain_copy.seq) <= 0) continue;
+		found = true;
+		retain_slot = i;
+		retain_copy = r;
+	}
+	if (!(reset & _BV(PORF)) && retain.crc == retain_crc(&retain)) {
+		clock_unset = retain.clock_unset;
+	} else {
+		clock_unset = true;
+		if (!found) return;
+		retain = retain_copy;
+	}
+	epoch = retain.epoch;
+	for (uint8_t i = 0; i < CHANNELS; i++) {
+		control[i].outputSum = retain.outputSum[i];
+		control[i].lastInput = retain.lastInput[i];
+		if (profile[i].automatic) profile[i].dim = retain.dim[i];
+	}
+}
+
+// Arms the clock for the next schedule transition, the first time after now
+// that the local time reaches its minute of the week
+static void sched_arm(void) {
+	uint32_t alarm = UINT32_MAX;
+	if (sched_next != SCHED_NEVER) {
+		uint32_t now = clock_local();
+		uint32_t day = now / SECS_PER_DAY;
+		alarm = (day - (day + 5) % 7) * SECS_PER_DAY + sched_next * 60UL;  // From Monday 0:00
+		if (alarm <= now) alarm += SECS_PER_WEEK;
+		alarm -= calendar_dst(alarm, dst_rule);
+		uint32_t std = now - calendar_dst(now - 3600, dst_rule);
+		if (alarm <= std) alarm = std + 1;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sched_alarm = alarm;
+	}
+}
+
+// Finds the schedule transition in effect after the clock or schedule changed
+static void sched_sync(void) {
+	uint32_t now = clock_local();
+	uint16_t day = now / SECS_PER_DAY;
+	eeprom_pause();
+	sched_seek((day + 5) % 7 * 1440 + now % SECS_PER_DAY / 60);
+	eeprom_resume();
+	sched_arm();
+}
+
+static void blink_buffer(void) {
+	if (blink) memset(buffer, ' ', strlen(buffer));
+}
+
+// Takes the oldest event from the queue, false when it is empty
+static bool key_get(key_event_t *e) {
+	uint8_t tail = key_tail;
+	if (tail == key_head) return false;
+	*e = key_queue[tail % KEY_QUEUE];
+	key_tail = tail + 1;
+	return true;
+}
+
+// Returns the button of the next press or repeat, the menus ignore other events
+static uint8_t key_read(void) {
+	key_event_t e;
+	while (key_get(&e)) {
+		if (e.event == KEY_PRESS || e.event == KEY_REPEAT) return e.key;
+	}
+	return KEY_NONE;
+}
+
+// Home screen
+static uint8_t home(void) {
+	uint8_t key = key_read();
+	if (key != KEY_NONE) return 4 - key;
 	pcd8544_clear();
-	pcd8544_write_string(itostr(ch0_dim, buffer, 0, 1), 0);
+	pcd8544_write_string(itostr(profile[0].dim, buffer, 0, 1), 0);
 	pcd8544_write_char('/', 0);
-	pcd8544_write_string(itostr(ch1_dim, buffer, 0, 1), 0);
-	if (is_daytime()) {
+	pcd8544_write_string(itostr(profile[1].dim, buffer, 0, 1), 0);
+	if (sched_period != SCHED_NONE && !clock_unset) {
 		pcd8544_set_cursor(42, 0);
 		pcd8544_write_char('*', 0);
 	}
 	pcd8544_set_cursor(54, 0);
-	itostr(time_hour, buffer, 0, 2);
-	buffer[2] = time_sec % 2 ? ':' : ' ';
-	itostr(time_min, &buffer[3], 0, 2);
+	datetime_t now;
+	calendar_split(clock_local(), &now);
+	itostr(now.hour, buffer, 0, 2);
+	buffer[2] = now.sec % 2 ? ':' : ' ';
+	itostr(now.min, &buffer[3], 0, 2);
+	if (clock_unset) blink_buffer();
 	pcd8544_write_string(buffer, 0);
-	if (sensor1 != 1) {
+	if (sensor[1] != 1) {
 		pcd8544_set_font(Font6x14B);
 		pcd8544_set_cursor(0, 8);
-		pcd8544_write_string(sensor0 ? strcpy_P(buffer, PSTR("--")) : itostr(temperature0, buffer, 1, 2), 0);
+		pcd8544_write_string(sensor[0] ? strcpy_P(buffer, PSTR("--")) : itostr(temperature[0], buffer, 1, 2), 0);
 		pcd8544_write_char('/', 0);
-		pcd8544_write_string(sensor1 ? strcpy_P(buffer, PSTR("--")) : itostr(temperature1, buffer, 1, 2), 0);
+		pcd8544_write_string(sensor[1] ? strcpy_P(buffer, PSTR("--")) : itostr(temperature[1], buffer, 1, 2), 0);
 		pcd8544_write_string_P("\x7f\x43\n", 0);
-		pcd8544_write_string(sensor0 ? strcpy_P(buffer, PSTR("--")) : itostr(humidity0, buffer, 1, 2), 0);
+		pcd8544_write_string(sensor[0] ? strcpy_P(buffer, PSTR("--")) : itostr(humidity[0], buffer, 1, 2), 0);
 		pcd8544_write_char('/', 0);
-		pcd8544_write_string(sensor1 ? strcpy_P(buffer, PSTR("--")) : itostr(humidity1, buffer, 1, 2), 0);
+		pcd8544_write_string(sensor[1] ? strcpy_P(buffer, PSTR("--")) : itostr(humidity[1], buffer, 1, 2), 0);
 		pcd8544_write_char('%', 0);
 		pcd8544_set_font(Font5x7);
 	} else {
-		switch (sensor0) {
+		switch (sensor[0]) {
 			case 0:
 				pcd8544_set_font(Font10x15B);
-				pcd8544_set_cursor(temperature0 < 0 ? 0 : 12, 8);
-				pcd8544_write_string(itostr(temperature0, buffer, 1, 2), 0);
+				pcd8544_set_cursor(temperature[0] < 0 ? 0 : 12, 8);
+				pcd8544_write_string(itostr(temperature[0], buffer, 1, 2), 0);
 				pcd8544_write_string_P("\x7f\x43", 0);
 				pcd8544_set_cursor(12, 24);
-				pcd8544_write_string(itostr(humidity0, buffer, 1, 2), 0);
+				pcd8544_write_string(itostr(humidity[0], buffer, 1, 2), 0);
 				pcd8544_write_char('%', 0);
 				pcd8544_set_font(Font5x7);
 				break;
@@ -314,165 +1034,275 @@ static uint8_t home(void) {
 	return HOME;
 }
 
-static void eeprom_save(void) {
-	eeprom_update_byte(&nv_magic, 0x55);
-	eeprom_update_byte(&nv_ch0_auto, ch0_auto);
-	eeprom_update_byte(&nv_ch0_dim, ch0_dim);
-	eeprom_update_byte(&nv_ch0_on_off, ch0_on_off);
-	eeprom_update_byte(&nv_ch1_auto, ch1_auto);
-	eeprom_update_byte(&nv_ch1_dim, ch1_dim);
-	eeprom_update_byte(&nv_ch1_on_off, ch1_on_off);
-	eeprom_update_byte(&nv_start_hour, start_hour);
-	eeprom_update_byte(&nv_start_min, start_min);
-	eeprom_update_byte(&nv_length_hour, length_hour);
-	eeprom_update_byte(&nv_length_min, length_min);
-	eeprom_update_word(&nv_min_temp, min_temp);
-	eeprom_update_word(&nv_max_temp, max_temp);
-	eeprom_update_byte(&nvKp, Kp);
-	eeprom_update_byte(&nvKi, Ki);
-	eeprom_update_byte(&nvKd, Kd);
-	eeprom_update_byte(&nvdT, dT);
-	eeprom_update_byte(&nv_bl_mode, bl_mode);
-	eeprom_update_byte(&nv_contrast, contrast);
-	eeprom_update_byte(&nv_on_off_thres, on_off_thres);
-}
-
-static void blink_buffer(void) {
-	if (blink) memset(buffer, ' ', strlen(buffer));
-}
-
 // Setup screen
 static uint8_t setup(void) {
 	static uint8_t item = 1, select = 0, sub = 0;
-	if (button[3]) {  // Back
-		button[3] = false;
+	datetime_t now;
+	calendar_split(clock_local(), &now);
+	uint8_t key = key_read();
+	if (key == KEY_BACK) {
 		if (select) {
 			select = 0;
 		} else {
 			eeprom_save();
+			sched_sync();
 			return HOME;
 		}
 	}
-	if (button[2]) {  // Select
-		button[2] = false;
+	if (key == KEY_SELECT) {
+		if (item == 5) return SCHEDULE;
 		switch (select) {
 			case 0:
 				select = item;
 				sub = 1;
 				break;
 			case 1:
+			case 2:
 				if (++sub > 3) select = 0;
 				break;
-			case 2:
 			case 3:
 				if (++sub > 2) select = 0;
 				break;
-			case 4:
-			case 5:
+			default:
 				select = 0;
 		}
 	}
-	if (button[1]) {  // Up
-		button[1] = false;
+	if (key == KEY_UP) {
 		switch (select) {
 			case 0:
 				if (--item == 0) item = 5;
 				break;
 			case 1:
-				if (sub == 1) if (++time_hour > 23) time_hour = 0;
-				if (sub == 2) if (++time_min > 59) time_min = 0;
-				if (sub == 3) if (++time_sec > 59) time_sec = 0;
+				if (sub == 1) if (++now.hour > 23) now.hour = 0;
+				if (sub == 2) if (++now.min > 59) now.min = 0;
+				if (sub == 3) if (++now.sec > 59) now.sec = 0;
 				break;
 			case 2:
-				if (sub == 1) if (++start_hour > 23) start_hour = 0;
-				if (sub == 2) if (++start_min > 59) start_min = 0;
+				if (sub == 1) if (++now.day > calendar_days(now.year, now.month)) now.day = 1;
+				if (sub == 2) if (++now.month > 12) now.month = 1;
+				if (sub == 3) if (++now.year > 99) now.year = 0;
 				break;
 			case 3:
-				if (sub == 1) if (++length_hour > 23) length_hour = 0;
-				if (sub == 2) if (++length_min > 59) length_min = 0;
+				if (sub == 1) if (++dst_rule >= DST_RULES) dst_rule = DST_OFF;
+				if (sub == 2) clock_ref = clock_ref == 0 ? 50 : clock_ref == 50 ? 60 : 0;
 				break;
 			case 4:
-				if (min_temp < 800) min_temp += 5;
-				break;
-			case 5:
-				if (min_temp < 800) max_temp += 5;
+				if (profile[edit_ch].base_temp < 800) profile[edit_ch].base_temp += 5;
 		}
+		if (select == 1 || select == 2) clock_set(&now);
 	}
-	if (button[0]) {  // Down
-		button[0] = false;
+	if (key == KEY_DOWN) {
 		switch (select) {
 			case 0:
 				if (++item > 5) item = 1;
 				break;
 			case 1:
-				if (sub == 1) if (--time_hour > 23) time_hour = 23;
-				if (sub == 2) if (--time_min > 59) time_min = 59;
-				if (sub == 3) if (--time_sec > 59) time_sec = 59;
+				if (sub == 1) if (--now.hour > 23) now.hour = 23;
+				if (sub == 2) if (--now.min > 59) now.min = 59;
+				if (sub == 3) if (--now.sec > 59) now.sec = 59;
 				break;
 			case 2:
-				if (sub == 1) if (--start_hour > 23) start_hour = 23;
-				if (sub == 2) if (--start_min > 59) start_min = 59;
+				if (sub == 1) if (--now.day == 0) now.day = calendar_days(now.year, now.month);
+				if (sub == 2) if (--now.month == 0) now.month = 12;
+				if (sub == 3) if (--now.year > 99) now.year = 99;
 				break;
 			case 3:
-				if (sub == 1) if (--length_hour > 23) length_hour = 23;
-				if (sub == 2) if (--length_min > 59) length_min = 59;
+				if (sub == 1) if (dst_rule-- == 0) dst_rule = DST_RULES - 1;
+				if (sub == 2) clock_ref = clock_ref == 0 ? 60 : clock_ref == 60 ? 50 : 0;
 				break;
 			case 4:
-				if (min_temp > -400) min_temp -= 5;
-				break;
-			case 5:
-				if (min_temp > -400) max_temp -= 5;
+				if (profile[edit_ch].base_temp > -400) profile[edit_ch].base_temp -= 5;
 		}
+		if (select == 1 || select == 2) clock_set(&now);
 	}
+	calendar_split(clock_local(), &now);
 	pcd8544_clear();
 	bool inv = item == 1;
 	pcd8544_write_string_P("Time ", inv);
 	memset(buffer, ' ', 8);
-	if (!(select == 1 && sub == 1 && blink)) itostr(time_hour, buffer, 0, 2);
+	if (!(select == 1 && sub == 1 && blink)) itostr(now.hour, buffer, 0, 2);
 	buffer[2] = ':';
-	if (!(select == 1 && sub == 2 && blink)) itostr(time_min, &buffer[3], 0, 2);
+	if (!(select == 1 && sub == 2 && blink)) itostr(now.min, &buffer[3], 0, 2);
 	buffer[5] = ':';
-	if (!(select == 1 && sub == 3 && blink)) itostr(time_sec, &buffer[6], 0, 2);
+	if (!(select == 1 && sub == 3 && blink)) itostr(now.sec, &buffer[6], 0, 2);
 	buffer[8] = 0;
 	pcd8544_write_string(buffer, inv);
 	inv = item == 2;
-	pcd8544_write_string_P("\nStart ", inv);
+	pcd8544_write_char('\n', inv);
+	strcpy_P(buffer, str_days[now.wday]);
+	pcd8544_write_string(buffer, inv);
+	pcd8544_write_char(' ', inv);
 	memset(buffer, ' ', 8);
-	if (!(select == 2 && sub == 1 && blink)) itostr(start_hour, buffer, 0, 2);
+	if (!(select == 2 && sub == 1 && blink)) itostr(now.day, buffer, 0, 2);
+	buffer[2] = '-';
+	if (!(select == 2 && sub == 2 && blink)) itostr(now.month, &buffer[3], 0, 2);
+	buffer[5] = '-';
+	if (!(select == 2 && sub == 3 && blink)) itostr(now.year, &buffer[6], 0, 2);
+	buffer[8] = 0;
+	pcd8544_write_string(buffer, inv);
+	inv = item == 3;
+	pcd8544_write_string_P("\nDST ", inv);
+	strcpy_P(buffer, str_dst[dst_rule]);
+	if (select == 3 && sub == 1) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	pcd8544_write_char(' ', inv);
+	if (clock_ref) {
+		itostr(clock_ref, buffer, 0, 1);
+		strcat_P(buffer, PSTR("Hz"));
+	} else {
+		strcpy_P(buffer, PSTR("Xtal"));
+	}
+	if (select == 3 && sub == 2) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 4;
+	pcd8544_write_string_P("\nCh", inv);
+	pcd8544_write_char('0' + edit_ch, inv);
+	pcd8544_write_string_P(" base ", inv);
+	itostr(profile[edit_ch].base_temp, buffer, 1, 2);
+	if (select == 4) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	pcd8544_write_string_P("\nSchedule", item == 5);
+	pcd8544_set_cursor(0, 40);
+	pcd8544_write_string_p(str_buttons, 0);
+	pcd8544_update();
+	return SETUP;
+}
+
+// Schedule screen
+static uint8_t schedule(void) {
+	static uint8_t item = 1, select = 0, sub = 0, n = 0;
+	period_t period;
+	sched_get(n, &period);
+	uint8_t key = key_read();
+	if (key == KEY_BACK) {
+		if (select) {
+			select = 0;
+		} else {
+			eeprom_save();
+			sched_compile();
+			sched_sync();
+			return HOME;
+		}
+	}
+	if (key == KEY_SELECT) {
+		switch (select) {
+			case 0:
+				select = item;
+				sub = 1;
+				break;
+			case 2:
+			case 3:
+				if (++sub > 2) select = 0;
+				break;
+			default:
+				select = 0;
+		}
+	}
+	if (key == KEY_UP) {
+		switch (select) {
+			case 0:
+				if (--item == 0) item = 5;
+				break;
+			case 1:
+				if (++n >= SCHED_SIZE) n = 0;
+				break;
+			case 2:
+				if (sub == 1) period.start = (period.start + 60) % 1440;
+				if (sub == 2) period.start = period.start / 60 * 60 + (period.start % 60 + 1) % 60;
+				break;
+			case 3:
+				if (sub == 1) period.length = (period.length + 60) % 1440;
+				if (sub == 2) period.length = period.length / 60 * 60 + (period.length % 60 + 1) % 60;
+				break;
+			case 4:
+			case 5:
+				if (period.temp[select - 4] < 800) period.temp[select - 4] += 5;
+		}
+		if (select > 1) sched_save(n, &period);
+	}
+	if (key == KEY_DOWN) {
+		switch (select) {
+			case 0:
+				if (++item > 5) item = 1;
+				break;
+			case 1:
+				if (n-- == 0) n = SCHED_SIZE - 1;
+				break;
+			case 2:
+				if (sub == 1) period.start = (period.start + 1380) % 1440;
+				if (sub == 2) period.start = period.start / 60 * 60 + (period.start % 60 + 59) % 60;
+				break;
+			case 3:
+				if (sub == 1) period.length = (period.length + 1380) % 1440;
+				if (sub == 2) period.length = period.length / 60 * 60 + (period.length % 60 + 59) % 60;
+				break;
+			case 4:
+			case 5:
+				if (period.temp[select - 4] > -400) period.temp[select - 4] -= 5;
+		}
+		if (select > 1) sched_save(n, &period);
+	}
+	sched_get(n, &period);
+	pcd8544_clear();
+	bool inv = item == 1;
+	pcd8544_write_string_P("Period ", inv);
+	strcpy_P(buffer, str_days[n / SCHED_PERIODS]);
+	buffer[3] = ' ';
+	itostr(n % SCHED_PERIODS + 1, &buffer[4], 0, 1);
+	if (select == 1) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 2;
+	pcd8544_write_string_P("\nStart ", inv);
+	memset(buffer, ' ', 5);
+	if (!(select == 2 && sub == 1 && blink)) itostr(period.start / 60, buffer, 0, 2);
 	buffer[2] = ':';
-	if (!(select == 2 && sub == 2 && blink)) itostr(start_min, &buffer[3], 0, 2);
+	if (!(select == 2 && sub == 2 && blink)) itostr(period.start % 60, &buffer[3], 0, 2);
 	buffer[5] = 0;
 	pcd8544_write_string(buffer, inv);
 	inv = item == 3;
 	pcd8544_write_string_P("\nLength ", inv);
 	memset(buffer, ' ', 5);
-	if (!(select == 3 && sub == 1 && blink)) itostr(length_hour, buffer, 0, 2);
+	if (!(select == 3 && sub == 1 && blink)) itostr(period.length / 60, buffer, 0, 2);
 	buffer[2] = ':';
-	if (!(select == 3 && sub == 2 && blink)) itostr(length_min, &buffer[3], 0, 2);
+	if (!(select == 3 && sub == 2 && blink)) itostr(period.length % 60, &buffer[3], 0, 2);
 	buffer[5] = 0;
 	pcd8544_write_string(buffer, inv);
-	inv = item == 4;
-	pcd8544_write_string_P("\nMin temp ", inv);
-	itostr(min_temp, buffer, 1, 2);
-	if (select == 4) blink_buffer();
-	pcd8544_write_string(buffer, inv);
-	inv = item == 5;
-	pcd8544_set_cursor(0, 32);
-	pcd8544_write_string_P("Max temp ", inv);
-	itostr(max_temp, buffer, 1, 2);
-	if (select == 5) blink_buffer();
-	pcd8544_write_string(buffer, inv);
+	for (uint8_t ch = 0; ch < CHANNELS; ch++) {
+		inv = item == ch + 4;
+		pcd8544_write_string_P("\nCh", inv);
+		pcd8544_write_char('0' + ch, inv);
+		pcd8544_write_char(' ', inv);
+		itostr(period.temp[ch], buffer, 1, 2);
+		if (select == ch + 4) blink_buffer();
+		pcd8544_write_string(buffer, inv);
+	}
 	pcd8544_set_cursor(0, 40);
 	pcd8544_write_string_p(str_buttons, 0);
 	pcd8544_update();
-	return SETUP;
+	return SCHEDULE;
+}
+
+// Returns the channel screen input item for a profile
+static uint8_t input_get(const profile_t *p) {
+	return p->fusion == FUSE_WEIGHTED ? FUSE_WEIGHTED + p->weight / 10 - 1 : p->fusion;
+}
+
+// Sets the fusion policy and weight of a profile from an input item
+static void input_set(profile_t *p, uint8_t input) {
+	if (input >= FUSE_WEIGHTED) {
+		p->fusion = FUSE_WEIGHTED;
+		p->weight = (input - FUSE_WEIGHTED + 1) * 10;
+	} else {
+		p->fusion = input;
+	}
 }
 
 // Channel screen
 static uint8_t channel(void) {
 	static uint8_t item = 1, select = 0;
-	if (button[3]) {  // Back
-		button[3] = false;
+	profile_t *p = &profile[edit_ch];
+	uint8_t key = key_read();
+	if (key == KEY_BACK) {
 		if (select) {
 			select = 0;
 		} else {
@@ -480,133 +1310,195 @@ static uint8_t channel(void) {
 			return HOME;
 		}
 	}
-	if (button[2]) {  // Select
-		button[2] = false;
+	if (key == KEY_SELECT) {
+		if (item == 5) return SWITCH;
 		select = select ? 0 : item;
 	}
-	if (button[1]) {  // Up
-		button[1] = false;
+	if (key == KEY_UP) {
 		switch (select) {
 			case 0:
 				if (--item == 0) item = 5;
 				break;
 			case 1:
-				if (ch0_auto) {
-					ch0_auto = false;
-					ch0_dim = 0;
-				} else if (ch0_on_off && ch0_dim == 0) {
-					ch0_dim = DIM_STEPS;
-				} else if ((ch0_on_off && ch0_dim) || ++ch0_dim > DIM_STEPS) {
-					ch0_auto = true;
-					ch0_dim = 0;
-				}
+				if (++edit_ch >= CHANNELS) edit_ch = 0;
 				break;
 			case 2:
-				ch0_on_off = !ch0_on_off;
-				if (ch0_on_off) ch0_dim = ch0_dim ? DIM_STEPS : 0;
+				if (p->automatic) {
+					p->automatic = false;
+					p->dim = 0;
+				} else if (p->on_off && p->dim == 0) {
+					p->dim = DIM_STEPS;
+				} else if ((p->on_off && p->dim) || ++p->dim > DIM_STEPS) {
+					p->automatic = true;
+					p->dim = 0;
+				}
 				break;
 			case 3:
-				if (ch1_auto) {
-					ch1_auto = false;
-					ch1_dim = 0;
-				} else if (ch1_on_off && ch1_dim == 0) {
-					ch1_dim = DIM_STEPS;
-				} else if ((ch1_on_off && ch1_dim) || ++ch1_dim > DIM_STEPS) {
-					ch1_auto = true;
-					ch1_dim = 0;
-				}
+				p->on_off = !p->on_off;
+				if (p->on_off) p->dim = p->dim ? DIM_STEPS : 0;
 				break;
 			case 4:
-				ch1_on_off = !ch1_on_off;
-				if (ch1_on_off) ch1_dim = ch1_dim ? DIM_STEPS : 0;
-				break;
-			case 5:
-				if (++on_off_thres > DIM_STEPS) on_off_thres = 0;
+				input_set(p, input_get(p) + 1 < INPUTS ? input_get(p) + 1 : 0);
 		}
 	}
-	if (button[0]) {  // Down
-		button[0] = false;
+	if (key == KEY_DOWN) {
 		switch (select) {
 			case 0:
 				if (++item > 5) item = 1;
 				break;
 			case 1:
-				if (ch0_auto) {
-					ch0_auto = false;
-					ch0_dim = DIM_STEPS;
-				} else if (ch0_on_off && ch0_dim) {
-					ch0_dim = 0;
-				} else if ((ch0_on_off && ch0_dim == 0) || ch0_dim-- == 0) {
-					ch0_auto = true;
-					ch0_dim = 0;
-				}
+				if (edit_ch-- == 0) edit_ch = CHANNELS - 1;
 				break;
 			case 2:
-				ch1_on_off = !ch1_on_off;
-				if (ch1_on_off) ch1_dim = ch1_dim ? DIM_STEPS : 0;
+				if (p->automatic) {
+					p->automatic = false;
+					p->dim = DIM_STEPS;
+				} else if (p->on_off && p->dim) {
+					p->dim = 0;
+				} else if ((p->on_off && p->dim == 0) || p->dim-- == 0) {
+					p->automatic = true;
+					p->dim = 0;
+				}
 				break;
 			case 3:
-				if (ch1_auto) {
-					ch1_auto = false;
-					ch1_dim = DIM_STEPS;
-				} else if (ch1_on_off && ch1_dim) {
-					ch1_dim = 0;
-				} else if ((ch1_on_off && ch1_dim == 0) || ch1_dim-- == 0) {
-					ch1_auto = true;
-					ch1_dim = 0;
-				}
+				p->on_off = !p->on_off;
+				if (p->on_off) p->dim = p->dim ? DIM_STEPS : 0;
 				break;
 			case 4:
-				ch1_on_off = !ch1_on_off;
-				if (ch1_on_off) ch1_dim = ch1_dim ? DIM_STEPS : 0;
-				break;
-			case 5:
-				if (--on_off_thres > DIM_STEPS) on_off_thres = DIM_STEPS;
+				input_set(p, input_get(p) ? input_get(p) - 1 : INPUTS - 1);
 		}
 	}
+	p = &profile[edit_ch];
 	pcd8544_clear();
 	bool inv = item == 1;
-	pcd8544_write_string_P("Ch 0 ", inv);
-	if (ch0_auto)
+	pcd8544_write_string_P("Channel ", inv);
+	itostr(edit_ch, buffer, 0, 1);
+	if (select == 1) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 2;
+	pcd8544_write_string_P("\nMode ", inv);
+	if (p->automatic)
 		strcpy_P(buffer, str_auto);
 	else
-		itostr(ch0_dim, buffer, 0, 1);
+		itostr(p->dim, buffer, 0, 1);
+	if (select == 2) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 3;
+	pcd8544_write_string_P("\nOutput ", inv);
+	strcpy_P(buffer, p->on_off ? str_on_off : str_dimming);
+	if (select == 3) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 4;
+	pcd8544_write_string_P("\nInput ", inv);
+	if (p->fusion == FUSE_WEIGHTED) {
+		strcpy_P(buffer, PSTR("W0:"));
+		itostr(p->weight, buffer + 3, 0, 1);
+		strcat_P(buffer, PSTR("%"));
+	} else {
+		strcpy_P(buffer, str_fusion[p->fusion]);
+	}
+	if (select == 4) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	pcd8544_write_string_P("\nSwitching", item == 5);
+	pcd8544_set_cursor(0, 40);
+	pcd8544_write_string_p(str_buttons, 0);
+	pcd8544_update();
+	return CHANNEL;
+}
+
+// On/off switching screen
+static uint8_t switching(void) {
+	static uint8_t item = 1, select = 0;
+	profile_t *p = &profile[edit_ch];
+	uint8_t key = key_read();
+	if (key == KEY_BACK) {
+		if (select) {
+			select = 0;
+		} else {
+			eeprom_save();
+			return HOME;
+		}
+	}
+	if (key == KEY_SELECT) {
+		select = select ? 0 : item;
+	}
+	if (key == KEY_UP) {
+		switch (select) {
+			case 0:
+				if (--item == 0) item = 4;
+				break;
+			case 1:
+				if (++p->hyst > 50) p->hyst = 0;
+				break;
+			case 2:
+				if (++p->min_on > 90) p->min_on = 0;
+				break;
+			case 3:
+				if (++p->min_off > 90) p->min_off = 0;
+				break;
+			case 4:
+				if (++p->window > 60) p->window = 0;
+		}
+	}
+	if (key == KEY_DOWN) {
+		switch (select) {
+			case 0:
+				if (++item > 4) item = 1;
+				break;
+			case 1:
+				if (p->hyst-- == 0) p->hyst = 50;
+				break;
+			case 2:
+				if (p->min_on-- == 0) p->min_on = 90;
+				break;
+			case 3:
+				if (p->min_off-- == 0) p->min_off = 90;
+				break;
+			case 4:
+				if (p->window-- == 0) p->window = 60;
+		}
+	}
+	pcd8544_clear();
+	bool inv = item == 1;
+	pcd8544_write_string_P("Ch", inv);
+	pcd8544_write_char('0' + edit_ch, inv);
+	pcd8544_write_string_P(" Hyst ", inv);
+	itostr(p->hyst, buffer, 1, 2);
 	if (select == 1) blink_buffer();
 	pcd8544_write_string(buffer, inv);
 	inv = item == 2;
-	pcd8544_write_string_P("\nCh 0 ", inv);
-	strcpy_P(buffer, ch0_on_off ? str_on_off : str_dimming);
+	pcd8544_write_string_P("\nMin on ", inv);
+	itostr(p->min_on * 10, buffer, 0, 1);
 	if (select == 2) blink_buffer();
 	pcd8544_write_string(buffer, inv);
+	pcd8544_write_char('s', inv);
 	inv = item == 3;
-	pcd8544_write_string_P("\nCh 1 ", inv);
-	if (ch1_auto)
-		strcpy_P(buffer, str_auto);
-	else
-		itostr(ch1_dim, buffer, 0, 1);
+	pcd8544_write_string_P("\nMin off ", inv);
+	itostr(p->min_off * 10, buffer, 0, 1);
 	if (select == 3) blink_buffer();
 	pcd8544_write_string(buffer, inv);
+	pcd8544_write_char('s', inv);
 	inv = item == 4;
-	pcd8544_write_string_P("\nCh 1 ", inv);
-	strcpy_P(buffer, ch1_on_off ? str_on_off : str_dimming);
+	pcd8544_write_string_P("\nWindow ", inv);
+	if (p->window) {
+		itostr(p->window * 10, buffer, 0, 1);
+		strcat_P(buffer, PSTR("s"));
+	} else {
+		strcpy_P(buffer, PSTR("Off"));
+	}
 	if (select == 4) blink_buffer();
 	pcd8544_write_string(buffer, inv);
-	inv = item == 5;
-	pcd8544_write_string_P("\nThreshold ", inv);
-	itostr(on_off_thres, buffer, 0, 1);
-	if (select == 5) blink_buffer();
-	pcd8544_write_string(buffer, inv);
 	pcd8544_set_cursor(0, 40);
 	pcd8544_write_string_p(str_buttons, 0);
 	pcd8544_update();
-	return CHANNEL;
+	return SWITCH;
 }
 
 // PID control K values screen
 static uint8_t kval(void) {
 	static uint8_t item = 1, select = 0;
-	if (button[3]) {  // Back
-		button[3] = false;
+	uint8_t key = key_read();
+	if (key == KEY_BACK) {
 		if (select) {
 			select = 0;
 		} else {
@@ -614,62 +1506,81 @@ static uint8_t kval(void) {
 			return HOME;
 		}
 	}
-	if (button[2]) {  // Select
-		button[2] = false;
+	if (key == KEY_SELECT) {
 		select = select ? 0 : item;
 	}
-	if (button[1]) {  // Up
-		button[1] = false;
+	if (key == KEY_UP) {
 		switch (select) {
 			case 0:
-				if (--item == 0) item = 4;
+				if (--item == 0) item = 5;
 				break;
 			case 1:
-				Kp++;
+				profile[edit_ch].Kp++;
 				break;
 			case 2:
-				Ki++;
+				profile[edit_ch].Ki++;
 				break;
 			case 3:
-				Kd++;
+				if (++profile[edit_ch].Kd > KD_MAX) profile[edit_ch].Kd = 0;
 				break;
 			case 4:
 				if (++dT > 59) dT = 0;
+				break;
+			case 5: {
+				uint8_t ch = tune;
+				do {  // Skip manual channels
+					ch = ch < CHANNELS ? ch + 1 : 0;
+				} while (ch && !profile[ch - 1].automatic);
+				tune_start(ch);
+			}
 		}
 	}
-	if (button[0]) {  // Down
-		button[0] = false;
+	if (key == KEY_DOWN) {
 		switch (select) {
 			case 0:
-				if (++item > 4) item = 1;
+				if (++item > 5) item = 1;
 				break;
 			case 1:
-				Kp--;
+				profile[edit_ch].Kp--;
 				break;
 			case 2:
-				Ki--;
+				profile[edit_ch].Ki--;
 				break;
 			case 3:
-				Kd--;
+				if (--profile[edit_ch].Kd > KD_MAX) profile[edit_ch].Kd = KD_MAX;
 				break;
 			case 4:
 				if (--dT > 59) dT = 59;
+				break;
+			case 5: {
+				uint8_t ch = tune;
+				do {
+					ch = ch ? ch - 1 : CHANNELS;
+				} while (ch && !profile[ch - 1].automatic);
+				tune_start(ch);
+			}
 		}
 	}
 	pcd8544_clear();
 	bool inv = item == 1;
-	pcd8544_write_string_P("Kp ", inv);
-	itostr(Kp, buffer, 2, 3);
+	pcd8544_write_string_P("Ch", inv);
+	pcd8544_write_char('0' + edit_ch, inv);
+	pcd8544_write_string_P(" Kp ", inv);
+	itostr(profile[edit_ch].Kp, buffer, 2, 3);
 	if (select == 1) blink_buffer();
 	pcd8544_write_string(buffer, inv);
 	inv = item == 2;
-	pcd8544_write_string_P("\nKi ", inv);
-	itostr(Ki, buffer, 2, 3);
+	pcd8544_write_string_P("\nCh", inv);
+	pcd8544_write_char('0' + edit_ch, inv);
+	pcd8544_write_string_P(" Ki ", inv);
+	itostr(profile[edit_ch].Ki, buffer, 3, 4);
 	if (select == 2) blink_buffer();
 	pcd8544_write_string(buffer, inv);
 	inv = item == 3;
-	pcd8544_write_string_P("\nKd ", inv);
-	itostr(Kd, buffer, 2, 3);
+	pcd8544_write_string_P("\nCh", inv);
+	pcd8544_write_char('0' + edit_ch, inv);
+	pcd8544_write_string_P(" Kd ", inv);
+	itostr(profile[edit_ch].Kd, buffer, 2, 3);
 	if (select == 3) blink_buffer();
 	pcd8544_write_string(buffer, inv);
 	inv = item == 4;
@@ -678,6 +1589,19 @@ static uint8_t kval(void) {
 	if (select == 4) blink_buffer();
 	pcd8544_write_string(buffer, inv);
 	pcd8544_write_char('s', inv);
+	inv = item == 5;
+	pcd8544_write_string_P("\nTune ", inv);
+	if (tune) {
+		strcpy_P(buffer, PSTR("Ch "));
+		itostr(tune - 1, &buffer[3], 0, 1);
+		buffer[4] = ' ';
+		itostr(tune_cycle ? tune_cycle - 1 : 0, &buffer[5], 0, 1);
+		buffer[6] = '/';
+		itostr(TUNE_CYCLES, &buffer[7], 0, 1);
+	} else
+		strcpy_P(buffer, PSTR("Off"));
+	if (select == 5) blink_buffer();
+	pcd8544_write_string(buffer, inv);
 	pcd8544_set_cursor(0, 40);
 	pcd8544_write_string_p(str_buttons, 0);
 	pcd8544_update();
@@ -687,8 +1611,8 @@ static uint8_t kval(void) {
 // LCD screen
 static uint8_t etc(void) {
 	static uint8_t item = 1, select = 0;
-	if (button[3]) {  // Back
-		button[3] = false;
+	uint8_t key = key_read();
+	if (key == KEY_BACK) {
 		if (select) {
 			select = 0;
 		} else {
@@ -696,15 +1620,15 @@ static uint8_t etc(void) {
 			return HOME;
 		}
 	}
-	if (button[2]) {  // Select
-		button[2] = false;
+	if (key == KEY_SELECT) {
+		if (item == 4) return RAMP;
+		if (item == 5) return DIAG;
 		select = select ? 0 : item;
 	}
-	if (button[1]) {  // Up
-		button[1] = false;
+	if (key == KEY_UP) {
 		switch (select) {
 			case 0:
-				if (--item == 0) item = 2;
+				if (--item == 0) item = 5;
 				break;
 			case 1:
 				if (++bl_mode > 2) bl_mode = 0;
@@ -712,13 +1636,15 @@ static uint8_t etc(void) {
 			case 2:
 				if (++contrast > 90) contrast = 90;
 				pcd8544_contrast(contrast);
+				break;
+			case 3:
+				if (++stagger > STAGGER_MAX) stagger = 0;
 		}
 	}
-	if (button[0]) {  // Down
-		button[0] = false;
+	if (key == KEY_DOWN) {
 		switch (select) {
 			case 0:
-				if (++item > 2) item = 1;
+				if (++item > 5) item = 1;
 				break;
 			case 1:
 				if (bl_mode-- == 0) bl_mode = 2;
@@ -726,6 +1652,9 @@ static uint8_t etc(void) {
 			case 2:
 				if (--contrast < 30) contrast = 30;
 				pcd8544_contrast(contrast);
+				break;
+			case 3:
+				if (stagger-- == 0) stagger = STAGGER_MAX;
 		}
 	}
 	pcd8544_clear();
@@ -745,59 +1674,369 @@ static uint8_t etc(void) {
 	itostr(contrast, buffer, 0, 1);
 	if (select == 2) blink_buffer();
 	pcd8544_write_string(buffer, inv);
+	inv = item == 3;
+	pcd8544_write_string_P("\nStagger ", inv);
+	if (stagger)
+		itostr(stagger, buffer, 0, 1);
+	else
+		strcpy_P(buffer, PSTR("Off"));
+	if (select == 3) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	pcd8544_write_string_P("\nTransition", item == 4);
+	pcd8544_write_string_P("\nDiagnostics", item == 5);
 	pcd8544_set_cursor(0, 40);
 	pcd8544_write_string_p(str_buttons, 0);
 	pcd8544_update();
 	return ETC;
 }
 
-// PID control
-static int16_t pid(int16_t input, int16_t setpoint, int16_t *lastInput, int16_t *outputSum) {
-	int16_t output = 0;
-	int16_t error = setpoint - input;
-	int16_t dInput = input - *lastInput;
-	*lastInput = input;
-	*outputSum += Ki * 2 * error;
-#ifdef P_ON_M
-	*outputSum -= Kp * dInput;  // Proportional on Measurement
-#else
-	output = Kp * error;  // Proportional on Error
-#endif
-	*outputSum = constrain(*outputSum, 0, DIM_STEPS * 100);
-	output += *outputSum - Kd / 2 * dInput;  // Derivative on Measurement
-	output /= 100;
-	return constrain(output, 0, DIM_STEPS);
+// Transition screen
+static uint8_t ramp(void) {
+	static uint8_t item = 1, select = 0;
+	profile_t *p = &profile[edit_ch];
+	uint8_t key = key_read();
+	if (key == KEY_BACK) {
+		if (select) {
+			select = 0;
+		} else {
+			eeprom_save();
+			return HOME;
+		}
+	}
+	if (key == KEY_SELECT) {
+		select = select ? 0 : item;
+	}
+	if (key == KEY_UP) {
+		switch (select) {
+			case 0:
+				if (--item == 0) item = 5;
+				break;
+			case 1:
+				p->ramp++;
+				break;
+			case 2:
+				p->Kf++;
+				break;
+			case 3:
+				p->wKp++;
+				break;
+			case 4:
+				p->wKi++;
+				break;
+			case 5:
+				if (++p->wKd > KD_MAX) p->wKd = 0;
+		}
+	}
+	if (key == KEY_DOWN) {
+		switch (select) {
+			case 0:
+				if (++item > 5) item = 1;
+				break;
+			case 1:
+				p->ramp--;
+				break;
+			case 2:
+				p->Kf--;
+				break;
+			case 3:
+				p->wKp--;
+				break;
+			case 4:
+				p->wKi--;
+				break;
+			case 5:
+				if (--p->wKd > KD_MAX) p->wKd = KD_MAX;
+		}
+	}
+	pcd8544_clear();
+	bool inv = item == 1;
+	pcd8544_write_string_P("Ch", inv);
+	pcd8544_write_char('0' + edit_ch, inv);
+	pcd8544_write_string_P(" Ramp ", inv);
+	if (p->ramp)
+		itostr(p->ramp, buffer, 1, 2);
+	else
+		strcpy_P(buffer, PSTR("Off"));
+	if (select == 1) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 2;
+	pcd8544_write_string_P("\nFeed fwd ", inv);
+	itostr(p->Kf, buffer, 2, 3);
+	if (select == 2) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 3;
+	pcd8544_write_string_P("\nWarm Kp ", inv);
+	if (p->wKp)
+		itostr(p->wKp, buffer, 2, 3);
+	else
+		strcpy_P(buffer, PSTR("Off"));
+	if (select == 3) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 4;
+	pcd8544_write_string_P("\nWarm Ki ", inv);
+	itostr(p->wKi, buffer, 3, 4);
+	if (select == 4) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	inv = item == 5;
+	pcd8544_write_string_P("\nWarm Kd ", inv);
+	itostr(p->wKd, buffer, 2, 3);
+	if (select == 5) blink_buffer();
+	pcd8544_write_string(buffer, inv);
+	pcd8544_set_cursor(0, 40);
+	pcd8544_write_string_p(str_buttons, 0);
+	pcd8544_update();
+	return RAMP;
+}
+
+// Diagnostics screen
+enum {
+	PAGE_MAINS,
+	PAGE_SAMPLE,
+	PAGE_POWER,
+	PAGE_CLOCK,
+#ifdef PHASE_CHECK
+	PAGE_PHASE,
+#endif
+#ifdef ISR_STATS
+	PAGE_ISR, PAGE_HIST, PAGE_HIST_LAST = PAGE_HIST + STAT_COUNT - 1,
+#endif
+	DIAG_PAGES
+};
+
+static uint8_t diag(void) {
+	static uint8_t page = 0;
+	uint8_t key = key_read();
+	if (key == KEY_BACK) {
+		return HOME;
+	}
+	if (key == KEY_SELECT) {  // Clear
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			switch (page) {
+				case PAGE_MAINS:
+					zc_lost = zc_bad = 0;
+					break;
+				case PAGE_SAMPLE:
+					jitter_min = jitter_max = 0;
+					sample_overrun = 0;
+					break;
+				case PAGE_CLOCK:
+					ref_total = 0;
+					ref_windows = ref_rejected = 0;
+					break;
+#ifdef PHASE_CHECK
+				case PAGE_PHASE:
+					memset(phase_error, 0, sizeof(phase_error));
+					memset(phase_gate, 0, sizeof(phase_gate));
+					phase_tail = 0;
+					break;
+#endif
+#ifdef ISR_STATS
+				default:
+					isr_stat_clear();
+#endif
+			}
+		}
+	}
+	if (key == KEY_UP) {
+		if (page-- == 0) page = DIAG_PAGES - 1;
+	}
+	if (key == KEY_DOWN) {
+		if (++page >= DIAG_PAGES) page = 0;
+	}
+	pcd8544_clear();
+	switch (page) {
+		case PAGE_MAINS: {
+			uint16_t period, lost, bad;
+			int16_t asym;
+			bool good;
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				period = zc_period;
+				asym = zc_asym;
+				lost = zc_lost;
+				bad = zc_bad;
+				good = zc_good == ZC_SETTLE;
+			}
+			pcd8544_write_string_P("Mains ", 0);
+			if (good && period)
+				pcd8544_write_string(itostr(100000000UL / period, buffer, 2, 1), 0);
+			else
+				pcd8544_write_string_P("--", 0);
+			pcd8544_write_string_P("Hz\nAsym ", 0);
+			pcd8544_write_string(itostr(asym, buffer, 0, 1), 0);
+			pcd8544_write_string_P("us\nLost ", 0);
+			pcd8544_write_string(itostr(lost, buffer, 0, 1), 0);
+			pcd8544_write_string_P("\nBad ", 0);
+			pcd8544_write_string(itostr(bad, buffer, 0, 1), 0);
+			break;
+		}
+		case PAGE_SAMPLE:
+			// Deviation of the actual control interval from the scheduled one in ms
+			pcd8544_write_string_P("Sample ", 0);
+			pcd8544_write_string(itostr(sample_interval, buffer, 0, 1), 0);
+			pcd8544_write_string_P("s\nLast ", 0);
+			pcd8544_write_string(itostr(jitter_last * 125L / 32, buffer, 0, 1), 0);
+			pcd8544_write_string_P("ms\nMin ", 0);
+			pcd8544_write_string(itostr(jitter_min * 125L / 32, buffer, 0, 1), 0);
+			pcd8544_write_string_P("ms\nMax ", 0);
+			pcd8544_write_string(itostr(jitter_max * 125L / 32, buffer, 0, 1), 0);
+			pcd8544_write_string_P("ms\nOverrun ", 0);
+			pcd8544_write_string(itostr(sample_overrun, buffer, 0, 1), 0);
+			break;
+		case PAGE_POWER:
+			// Fraction of time the main loop was awake during the last second
+			pcd8544_write_string_P("Awake ", 0);
+			pcd8544_write_string(itostr(awake, buffer, 1, 2), 0);
+			pcd8544_write_string_P("%\nWakeups ", 0);
+			pcd8544_write_string(itostr(wake_rate, buffer, 0, 1), 0);
+			pcd8544_write_string_P("/s\nOsccal ", 0);
+			pcd8544_write_string(itostr(OSCCAL, buffer, 0, 1), 0);
+			pcd8544_write_string_P("\nOsc err ", 0);
+			pcd8544_write_string(itostr(cal_ppm / 100, buffer, 2, 3), 0);
+			pcd8544_write_string_P("%\nOsc steps ", 0);
+			pcd8544_write_string(itostr(cal_steps, buffer, 0, 1), 0);
+			break;
+		case PAGE_CLOCK:
+			// Crystal error measured against mains and the correction applied
+			pcd8544_write_string_P("Clock ", 0);
+			if (clock_ref) {
+				pcd8544_write_string(itostr(clock_ref, buffer, 0, 1), 0);
+				pcd8544_write_string_P("Hz", 0);
+			} else {
+				pcd8544_write_string_P("Xtal", 0);
+			}
+			pcd8544_write_string_P("\nRate ", 0);
+			pcd8544_write_string(itostr(ref_rate * 30 / 512, buffer, 1, 2), 0);
+			pcd8544_write_string_P("s/d\nAdjust ", 0);
+			pcd8544_write_string(itostr(ref_total * 10L / 256, buffer, 1, 2), 0);
+			pcd8544_write_string_P("s\nWindows ", 0);
+			pcd8544_write_string(itostr(ref_windows, buffer, 0, 1), 0);
+			pcd8544_write_string_P("\nRejected ", 0);
+			pcd8544_write_string(itostr(ref_rejected, buffer, 0, 1), 0);
+			break;
+#ifdef PHASE_CHECK
+		case PAGE_PHASE: {
+			// Firing angle error per dim level as bars, worst level and gate width in text
+			uint8_t worst = 1;
+			for (uint8_t i = 1; i <= DIM_STEPS; i++)
+				if (phase_error[i] > phase_error[worst]) worst = i;
+			uint16_t peak = phase_error[worst];
+			uint16_t gate = phase_gate[worst];
+			int16_t tail = phase_tail;
+			pcd8544_set_font(Font3x5);
+			pcd8544_write_string_P("Max error ", 0);
+			pcd8544_write_string(itostr(peak, buffer, 0, 1), 0);
+			pcd8544_write_string_P("us at ", 0);
+			pcd8544_write_string(itostr(worst, buffer, 0, 1), 0);
+			pcd8544_write_string_P("\nGate ", 0);
+			pcd8544_write_string(itostr(gate, buffer, 0, 1), 0);
+			pcd8544_write_string_P("us\nFull on tail ", 0);
+			pcd8544_write_string(itostr(tail, buffer, 0, 1), 0);
+			pcd8544_write_string_P("us", 0);
+			pcd8544_set_font(Font5x7);
+			if (peak == 0) peak = 1;
+			for (uint8_t i = 1; i <= DIM_STEPS; i++) {
+				uint8_t height = (uint32_t)phase_error[i] * 20 / peak;
+				if (height) pcd8544_draw_vline(16 + i, 38 - height, height);
+			}
+			break;
+		}
+#endif
+#ifdef ISR_STATS
+		case PAGE_ISR:
+			pcd8544_set_font(Font3x5);
+			pcd8544_write_string_P("ISR  Latency  Run time", 0);
+			for (uint8_t i = 0; i < STAT_COUNT; i++) {
+				isr_stat_t stat;
+				ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+					stat = isr_stat[i];
+				}
+				pcd8544_set_cursor(0, 6 + i * 6);
+				pcd8544_write_string_p(isr_names[i], 0);
+				if (stat.lat_min > stat.lat_max) continue;  // Not run yet
+				pcd8544_set_cursor(20, 6 + i * 6);
+				pcd8544_write_string(itostr(stat.lat_min, buffer, 0, 1), 0);
+				pcd8544_write_char('-', 0);
+				pcd8544_write_string(itostr(stat.lat_max, buffer, 0, 1), 0);
+				pcd8544_set_cursor(52, 6 + i * 6);
+				pcd8544_write_string(itostr(stat.run_min, buffer, 0, 1), 0);
+				pcd8544_write_char('-', 0);
+				pcd8544_write_string(itostr(stat.run_max, buffer, 0, 1), 0);
+			}
+			pcd8544_set_font(Font5x7);
+			break;
+		default: {
+			// Latency histogram with bars scaled to the largest bucket
+			uint8_t id = page - PAGE_HIST;
+			uint16_t hist[8], peak = 1;
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				memcpy(hist, isr_stat[id].hist, sizeof(hist));
+			}
+			for (uint8_t i = 0; i < 8; i++)
+				if (hist[i] > peak) peak = hist[i];
+			pcd8544_write_string_p(isr_names[id], 0);
+			pcd8544_write_string_P(" latency", 0);
+			for (uint8_t i = 0; i < 8; i++) {
+				uint8_t height = (uint32_t)hist[i] * 28 / peak;
+				if (height) pcd8544_fill_rect(i * 10 + 2, 38 - height, 8, height);
+			}
+		}
+#endif
+	}
+	pcd8544_set_cursor(0, 40);
+	pcd8544_write_string_P("Back Clr Up Dn", 0);
+	pcd8544_update();
+	return DIAG;
 }
 
+// Loads the record with the highest sequence number that passes its CRC check.
+// Only the headers are scanned, so normally a single record is read in full.
 static void eeprom_init(void) {
-	if (eeprom_read_byte(&nv_magic) != 0x55) return;
-	ch0_dim = eeprom_read_byte(&nv_ch0_dim);
-	ch1_dim = eeprom_read_byte(&nv_ch1_dim);
-	ch0_auto = eeprom_read_byte(&nv_ch0_auto);
-	ch1_auto = eeprom_read_byte(&nv_ch1_auto);
-	ch0_on_off = eeprom_read_byte(&nv_ch0_on_off);
-	ch1_on_off = eeprom_read_byte(&nv_ch1_on_off);
-	start_hour = eeprom_read_byte(&nv_start_hour);
-	start_min = eeprom_read_byte(&nv_start_min);
-	length_hour = eeprom_read_byte(&nv_length_hour);
-	length_min = eeprom_read_byte(&nv_length_min);
-	min_temp = eeprom_read_word(&nv_min_temp);
-	max_temp = eeprom_read_word(&nv_max_temp);
-	Kp = eeprom_read_byte(&nvKp);
-	Ki = eeprom_read_byte(&nvKi);
-	Kd = eeprom_read_byte(&nvKd);
-	dT = eeprom_read_byte(&nvdT);
-	bl_mode = eeprom_read_byte(&nv_bl_mode);
-	contrast = eeprom_read_byte(&nv_contrast);
-	on_off_thres = eeprom_read_byte(&nv_on_off_thres);
+	config_t *c = &config;
+	uint8_t rejected = 0;  // Bit mask of slots that failed the CRC check
+	for (;;) {
+		uint8_t best = CONFIG_SLOTS;
+		uint16_t best_seq = 0;
+		for (uint8_t i = 0; i < CONFIG_SLOTS; i++) {
+			if (rejected & _BV(i)) continue;
+			if (eeprom_read_byte(&nv_config[i].version) != CONFIG_VERSION) continue;
+			uint16_t seq = eeprom_read_word(&nv_config[i].seq);
+			if (best == CONFIG_SLOTS || (int16_t)(seq - best_seq) > 0) {
+				best = i;
+				best_seq = seq;
+			}
+		}
+		if (best == CONFIG_SLOTS) {
+			memset(c, 0, sizeof(config_t));  // Forces the first save
+			sched_default();
+			return;
+		}
+		eeprom_read_block(c, &nv_config[best], sizeof(config_t));
+		if (c->crc == config_crc(c)) {
+			config_slot = best;
+			break;
+		}
+		rejected |= _BV(best);
+	}
+	memcpy(profile, c->profile, sizeof(profile));
+	dT = c->dT;
+	bl_mode = c->bl_mode;
+	contrast = c->contrast;
+	stagger = c->stagger;
+	if (stagger > STAGGER_MAX) stagger = 0;
+	dst_rule = c->dst_rule;
+	if (dst_rule >= DST_RULES) dst_rule = DST_OFF;
+	clock_ref = c->clock_ref;
+	if (clock_ref != 50 && clock_ref != 60) clock_ref = 0;
 }
 
 int main(void) {
-	uint8_t view = HOME, prev_on_off = 0;
-	int16_t lastInput0 = 0, lastInput1 = 0;
-	int16_t outputSum0 = 0, outputSum1 = 0;
+	uint8_t view = HOME;
+	uint32_t last_sample = 0, last_second = 0;
 	i2c_init();
 	eeprom_init();
+	retain_init();
+	sched_compile();
+	sched_sync();
 	pcd8544_init();
 	pcd8544_set_font(Font5x7);
 	pcd8544_led_on();
@@ -807,54 +2046,140 @@ int main(void) {
 	pcd8544_clear();
 	pcd8544_update();
 	button_init();
+#ifdef ISR_STATS
+	isr_stat_clear();
+#endif
 	timer0_init();
 	timer1_init();
 	timer2_init();
 	pcd8544_led_off();
+	set_sleep_mode(SLEEP_MODE_IDLE);  // Timer1 must keep running for phase control
 	// Main loop
     while (1) {
-		if (view == HOME) view = home();
-		if (view == SETUP) view = setup();
-		if (view == CHANNEL) view = channel();
-		if (view == KVAL) view = kval();
-		if (view == ETC) view = etc();
+		PROBE_ON(PROBE_LOOP);
+		// Render only when something changed, other wake-ups go back to sleep
+		if (redraw || key_tail != key_head) {
+			PROBE_VIEW(view);
+			PROBE_ON(PROBE_RENDER);
+			uint8_t last_view = view;
+			redraw = false;
+			if (view == HOME) view = home();
+			if (view == SETUP) view = setup();
+			if (view == CHANNEL) view = channel();
+			if (view == KVAL) view = kval();
+			if (view == ETC) view = etc();
+			if (view == DIAG) view = diag();
+			if (view == RAMP) view = ramp();
+			if (view == SWITCH) view = switching();
+			if (view == SCHEDULE) {
+				eeprom_pause();
+				view = schedule();
+				eeprom_resume();
+			}
+			if (view != last_view || key_tail != key_head) redraw = true;
+			PROBE_OFF(PROBE_RENDER);
+		}
 		new_ocr0a = (bl_mode == ON || (bl_mode == AUTO && bl_delay)) ? 255 : 0;
-		if (sample_delay == 0) {
-			sample_delay = dT;
-			int16_t setpoint = is_daytime() ? max_temp : min_temp;
-			i2c_select(0);
-			if ((sensor0 = aht20_get(&humidity0, &temperature0)) == 1) {
-				sensor0 = am2320_get(&humidity0, &temperature0);
+		if (sched_due) {
+			eeprom_pause();
+			sched_advance();
+			eeprom_resume();
+			sched_arm();
+		}
+		if (sample_due) {
+			sample_due = false;
+			// Measure the actual interval, which the PID uses to scale its terms
+			uint8_t base = dT ? dT : 1;
+			uint16_t nominal = base * 256;
+			uint16_t scheduled = (sample_interval ? sample_interval : 1) * 256;
+			uint32_t now = timestamp();
+			uint16_t elapsed = last_sample ? now - last_sample : scheduled;
+			last_sample = now;
+			jitter_last = elapsed - scheduled;
+			if (jitter_last < jitter_min) jitter_min = jitter_last;
+			if (jitter_last > jitter_max) jitter_max = jitter_last;
+			uint8_t seconds = (elapsed + 128) >> 8;
+			for (uint8_t i = 0; i < SENSORS; i++) {
+				uint16_t h;
+				int16_t t;
+				PROBE_ON(PROBE_SENSOR);
+				i2c_select(i);
+				if ((sensor[i] = aht20_get(&h, &t)) == 1) {
+					sensor[i] = am2320_get(&h, &t);
+				}
+				if (sensor[i] == 0) {
+					humidity[i] = h;
+					temperature[i] = t;
+					sensor_age[i] = 0;
+				} else {
+					sensor_age[i] = sensor_age[i] < UINT16_MAX - seconds ? sensor_age[i] + seconds : UINT16_MAX;
+				}
+				PROBE_OFF(PROBE_SENSOR);
 			}
-			uint8_t output = pid(temperature0, setpoint, &lastInput0, &outputSum0);
-			uint8_t on_off = output > on_off_thres ? DIM_STEPS : 0;
-			if (on_off != prev_on_off) {
-				prev_on_off = on_off;
-				on_off_delay = ON_OFF_DELAY;
-			}
-			if (ch0_auto && sensor0 == 0) {
-				if (ch0_on_off) {
-					if (on_off_delay == 0) ch0_dim = on_off;
-				} else {
-					ch0_dim = output;
-				}
-			}
-			i2c_select(1);
-			if ((sensor1 = aht20_get(&humidity1, &temperature1)) == 1) {
-				sensor1 = am2320_get(&humidity1, &temperature1);
-			}
-			if (sensor1 == 0) {
-				output = pid(temperature1, setpoint, &lastInput1, &outputSum1);
-				on_off = output > on_off_thres ? DIM_STEPS : 0;
-			}
-			if (ch1_auto && (sensor0 == 0 || sensor1 == 0)) {
-				if (ch1_on_off) {
-					if (on_off_delay == 0) ch1_dim = on_off;
-				} else {
-					ch1_dim = output;
-				}
+			PROBE_ON(PROBE_CONTROL);
+			bool steady = !tune;  // Auto-tune counts periods in samples
+			for (uint8_t i = 0; i < CHANNELS; i++) {
+				profile_t *p = &profile[i];
+				int16_t input;
+				if (!fuse(i, temperature, sensor_age, sample_interval, &input)) {
+					if (tune == i + 1) {  // Abort on sensor failure
+						tune = 0;
+						p->dim = 0;
+					}
+					continue;
+				}
+				int16_t target = clock_unset ? p->base_temp : sched_setpoint(i);
+				int16_t setpoint = control_setpoint(i, target, input, elapsed);
+				uint8_t output = pid(i, input, setpoint, elapsed, nominal);
+				if (p->automatic && !control_steady(i, input, setpoint)) steady = false;
+				if (tune == i + 1 && !p->automatic) tune = 0;  // Switched to manual
+				if (tune == i + 1) {
+					p->dim = autotune(input, setpoint, elapsed);
+					control[i].outputSum = DIM_STEPS * 50;  // Resume from the average relay output
+					if (tune == 0) eeprom_save();
+				} else if (p->automatic) {
+					control_output(i, output, input, setpoint, elapsed);
+				}
 			}
+			sample_interval = control_interval(sample_interval, base, steady);
+			redraw = true;  // Show the new readings and outputs
+			PROBE_OFF(PROBE_CONTROL);
+		}
+		// Awake time and clock discipline once a second
+		uint32_t second;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			second = uptime;
+		}
+		if (second != last_second) {
+			clock_discipline();
+			calibrate_track(second - last_second);
+			control_tick(second - last_second);
+			retain_save(second - last_second);
+			last_second = second;
+			awake = slept < 1000000 ? (1000000 - slept) / 1000 : 0;
+			wake_rate = wakeups;
+			slept = wakeups = 0;
+		}
+		if (ref_adjust) clock_adjust();
+#ifdef PHASE_CHECK
+		phase_check_sample();
+#endif
+		PROBE_OFF(PROBE_LOOP);
+		// Sleep until an interrupt leaves work. Interrupts stay disabled from
+		// the check until the sleep instruction, so no wake-up can be missed.
+		cli();
+		if (!redraw && !sample_due && !sched_due) {
+			uint16_t start = TCNT1;
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				slept += (uint16_t)(TCNT1 - start);
+			}
+			wakeups++;
 		}
+		sei();
     }
 }
 
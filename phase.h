@@ -0,0 +1,64 @@
+/*
+ * Phase control timing
+ *
+ * Turns the zero-cross edges captured by Timer1 into the compare values that
+ * start and end the TRIAC gates of the next half cycle. It has no hardware
+ * dependencies, so the host build can replay mains edges through it. The
+ * function is inline to keep the capture ISR free of a call.
+ *
+ * Created: 18/10/2026 16:21:37
+ */ 
+
+
+#ifndef PHASE_H_
+#define PHASE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "control.h"
+
+// Gates of one half cycle in Timer1 ticks
+typedef struct {
+	uint16_t fire[CHANNELS];  // Count at which the gate is set
+	uint16_t gate[CHANNELS];  // Gate width, cleared at fire + gate
+} firing_t;
+
+// Plans the half cycle that follows the positive edge at rise. The half sine
+// from the negative edge at fall to rise is divided into DIM_STEPS and the
+// zero crossing is taken half a zero-cross pulse after rise. A gate ends half
+// a pulse before the next positive edge, or at that edge when fully on, so it
+// is off before the next zero crossing.
+// Channels that would fire close together are spread by stagger steps, lead
+// selects the channel that fires first. Alternated every full cycle, each
+// channel fires early and late on both half waves and no DC results. The
+// average angle is kept; the power of a channel is off by at most
+// sin^2(pi * stagger / DIM_STEPS) / pi of full power, 0,1% at a stagger of 1
+// and 3% at 5.
+static __inline__ void phase_plan(firing_t *f, uint16_t rise, uint16_t fall, uint16_t half_zero,
+		uint8_t dim0, uint8_t dim1, uint8_t stagger, bool lead) {
+	uint16_t dim_period = (uint16_t)(rise - fall) / DIM_STEPS;
+	uint16_t crossing = rise + half_zero;
+	uint16_t fire0 = dim_period * (DIM_STEPS - dim0);
+	uint16_t fire1 = dim_period * (DIM_STEPS - dim1);
+	uint16_t gate0 = dim_period * dim0;
+	if (dim0 == DIM_STEPS) gate0 += half_zero;
+	uint16_t gate1 = dim_period * dim1;
+	if (dim1 == DIM_STEPS) gate1 += half_zero;
+	if (stagger && abs(dim0 - dim1) < stagger
+			&& dim0 > stagger && dim0 < DIM_STEPS - stagger
+			&& dim1 > stagger && dim1 < DIM_STEPS - stagger) {
+		uint16_t shift = dim_period * stagger;
+		if (lead) shift = -shift;
+		fire0 -= shift;
+		gate0 += shift;
+		fire1 += shift;
+		gate1 -= shift;
+	}
+	f->fire[0] = crossing + fire0;
+	f->fire[1] = crossing + fire1;
+	f->gate[0] = gate0;
+	f->gate[1] = gate1;
+}
+
+#endif /* PHASE_H_ */
@@ -0,0 +1,132 @@
+/*
+ * Weekly schedule
+ *
+ * Created: 18/10/2026 14:05:31
+ */ 
+
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include "schedule.h"
+
+// Transition table entry, the period that starts at a minute of the week
+typedef struct {
+	uint16_t minute;
+	uint8_t period;
+} transition_t;
+
+// Schedule globals
+period_t EEMEM nv_sched[SCHED_SIZE];
+period_t sched_copy;
+uint8_t sched_slot = SCHED_NONE;
+transition_t sched_table[SCHED_SIZE * 2];
+uint8_t sched_size = 0;
+uint8_t sched_period = SCHED_NONE;
+uint8_t sched_index = 0;  // Table entry of the next transition
+int16_t sched_temp[CHANNELS];
+volatile uint16_t sched_next = SCHED_NEVER;
+volatile bool sched_due = false;
+
+// Reads a period, the edited one from RAM as its write may still be queued
+void sched_get(uint8_t n, period_t *period) {
+	if (n == sched_slot)
+		*period = sched_copy;
+	else
+		eeprom_read_block(period, &nv_sched[n], sizeof(period_t));
+}
+
+// Every day from 8:00 for 10 hours at 25 degrees. Written directly, this only
+// runs on the first start.
+void sched_default(void) {
+	period_t period = {8 * 60, 10 * 60, {250, 250}};
+	period_t unused = {0, 0, {250, 250}};
+	for (uint8_t n = 0; n < SCHED_SIZE; n++)
+		eeprom_update_block(n % SCHED_PERIODS ? &unused : &period, &nv_sched[n], sizeof(period_t));
+}
+
+// Returns the period that covers a minute of the week. When periods overlap,
+// the one that started last wins.
+static uint8_t sched_find(uint16_t minute) {
+	uint8_t found = SCHED_NONE;
+	uint16_t since = SCHED_MINUTES;
+	period_t period;
+	for (uint8_t n = 0; n < SCHED_SIZE; n++) {
+		sched_get(n, &period);
+		if (period.length == 0) continue;
+		uint16_t start = n / SCHED_PERIODS * 1440 + period.start;
+		uint16_t elapsed = (minute + SCHED_MINUTES - start) % SCHED_MINUTES;
+		if (elapsed < period.length && elapsed < since) {
+			since = elapsed;
+			found = n;
+		}
+	}
+	return found;
+}
+
+// Builds the transition table from the start and end of every period. The
+// points are insertion sorted without duplicates, then the period in effect
+// from each point on is looked up. This runs at start-up and after the
+// schedule changed, it only reads the EEPROM.
+void sched_compile(void) {
+	uint8_t size = 0;
+	period_t period;
+	for (uint8_t n = 0; n < SCHED_SIZE; n++) {
+		sched_get(n, &period);
+		if (period.length == 0) continue;
+		uint16_t start = n / SCHED_PERIODS * 1440 + period.start;
+		uint16_t edge[2] = {start, (start + period.length) % SCHED_MINUTES};
+		for (uint8_t e = 0; e < 2; e++) {
+			uint8_t i = size;
+			while (i && sched_table[i - 1].minute > edge[e]) i--;
+			if (i && sched_table[i - 1].minute == edge[e]) continue;
+			for (uint8_t j = size; j > i; j--) sched_table[j].minute = sched_table[j - 1].minute;
+			sched_table[i].minute = edge[e];
+			size++;
+		}
+	}
+	for (uint8_t i = 0; i < size; i++) sched_table[i].period = sched_find(sched_table[i].minute);
+	sched_size = size;
+}
+
+// Makes a table entry the active period and schedules the entry after it
+static void sched_apply(uint8_t i) {
+	sched_period = sched_table[i].period;
+	if (sched_period != SCHED_NONE) {
+		period_t period;
+		sched_get(sched_period, &period);
+		for (uint8_t ch = 0; ch < CHANNELS; ch++) sched_temp[ch] = period.temp[ch];
+	}
+	sched_index = i + 1 < sched_size ? i + 1 : 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sched_next = sched_table[sched_index].minute;
+		sched_due = false;
+	}
+}
+
+// Finds the transition in effect at a minute of the week, after the clock was
+// set or the schedule was compiled
+void sched_seek(uint16_t now) {
+	if (sched_size == 0) {
+		sched_period = SCHED_NONE;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			sched_next = SCHED_NEVER;
+			sched_due = false;
+		}
+		return;
+	}
+	uint8_t i = sched_size - 1;  // Wraps to the last transition of the week before
+	for (uint8_t j = 0; j < sched_size; j++) {
+		if (sched_table[j].minute > now) break;
+		i = j;
+	}
+	sched_apply(i);
+}
+
+// Moves to the next transition when the clock reached sched_next
+void sched_advance(void) {
+	sched_apply(sched_index);
+}
+
+// Returns the setpoint of a channel, the base temperature outside periods
+int16_t sched_setpoint(uint8_t ch) {
+	return sched_period == SCHED_NONE ? profile[ch].base_temp : sched_temp[ch];
+}
@@ -0,0 +1,48 @@
+/*
+ * Weekly schedule
+ *
+ * Each weekday has a number of periods with their own setpoints. The periods
+ * are compiled into a table of transitions sorted by minute of the week, so
+ * only the next transition has to be compared against the clock. The periods
+ * are stored in EEPROM, the table is kept in RAM and rebuilt at start-up.
+ *
+ * Created: 18/10/2026 14:05:12
+ */ 
+
+
+#ifndef SCHEDULE_H_
+#define SCHEDULE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "control.h"
+
+#define SCHED_DAYS 7
+#define SCHED_PERIODS 3             // Periods per weekday
+#define SCHED_SIZE (SCHED_DAYS * SCHED_PERIODS)
+#define SCHED_MINUTES (SCHED_DAYS * 1440U)
+#define SCHED_NONE 0xFF             // No period active
+#define SCHED_NEVER 0xFFFF          // No transition scheduled
+
+// Period of a weekday, stored in EEPROM
+typedef struct {
+	uint16_t start;          // Minute of the day
+	uint16_t length;         // Minutes, zero when unused, may cross midnight
+	int16_t temp[CHANNELS];  // Setpoints in tenths of a degree
+} period_t;
+
+extern period_t nv_sched[SCHED_SIZE];  // In EEPROM
+extern period_t sched_copy;            // Last edited period, the source of the write-behind queue
+extern uint8_t sched_slot;             // Period held in sched_copy or SCHED_NONE
+extern uint8_t sched_period;           // Active period or SCHED_NONE
+extern volatile uint16_t sched_next;   // Minute of the week of the next transition
+extern volatile bool sched_due;        // Set by the clock when sched_next is reached
+
+extern void sched_get(uint8_t n, period_t *period);
+extern void sched_default(void);
+extern void sched_compile(void);
+extern void sched_seek(uint16_t now);
+extern void sched_advance(void);
+extern int16_t sched_setpoint(uint8_t ch);
+
+#endif /* SCHEDULE_H_ */
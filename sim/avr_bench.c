@@ -0,0 +1,450 @@
+/*
+ * Firmware cycle benchmark
+ *
+ * Runs the firmware built by "make simavr" under simavr with scripted stimuli:
+ * a zero-cross pulse train on ICP1, an AHT20 on the TWI bus and an AM2320 on
+ * the software I2C bus, button presses on PC0-PC3 and an SPI sink for the LCD.
+ * The GPIOR0 probes of the firmware time every code section and GPIOR1 tells
+ * which screen a render drew. Sections are inclusive, so the main loop counts
+ * everything it calls and any section counts the interrupts that hit it.
+ *
+ * Created: 18/10/2026 16:52:37
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_time.h"
+#include "sim_cycle_timers.h"
+#include "avr_ioport.h"
+#include "avr_spi.h"
+#include "avr_twi.h"
+
+#define RUN 60          // Seconds simulated
+#define ZC_PULSE 600    // Zero-cross pulse width in us
+#define GPIOR0_ADDR 0x3E  // Data space addresses on the ATmega328P
+#define GPIOR1_ADDR 0x4A
+#define SDA 0           // Software I2C on PD0 and PD1, see i2c.c
+#define SCL 1
+#define LCD_DC 5        // LCD data/command and chip enable on PD5 and PD7
+#define LCD_SCE 7
+#define LCD_SIZE 504
+
+// Firmware enums, see main.c
+enum {PROBE_LOOP, PROBE_RENDER, PROBE_SENSOR, PROBE_CONTROL, PROBE_CAPT, PROBE_COMP, PROBE_TC0, PROBE_TC2, PROBES};
+static const char *probe_names[PROBES] = {"Loop", "Render", "Sensor", "Control", "Capt", "Comp", "Tc0", "Tc2"};
+enum {HOME, SETUP, CHANNEL, KVAL, ETC, DIAG, RAMP, SWITCH, SCHEDULE, VIEWS};
+static const char *view_names[VIEWS] = {"Home", "Setup", "Channel", "Pid", "Lcd", "Diag", "Ramp", "Switch", "Schedule"};
+enum {KEY_DOWN, KEY_UP, KEY_SELECT, KEY_BACK, KEYS};  // PC0-PC3
+
+// Button presses that visit every screen. The first press only turns on the
+// backlight.
+typedef struct {
+	uint32_t ms;     // Time of the press since reset
+	uint8_t key;
+	uint16_t hold;   // Length of the press in ms
+} press_t;
+
+static const press_t script[] = {
+	{2000, KEY_SELECT, 100},
+	{3000, KEY_BACK, 100},     // Setup
+	{4000, KEY_UP, 100},
+	{5000, KEY_SELECT, 100},   // Schedule
+	{7000, KEY_BACK, 100},
+	{8000, KEY_SELECT, 100},   // Channel
+	{9000, KEY_UP, 100},
+	{10000, KEY_SELECT, 100},  // Switch
+	{12000, KEY_BACK, 100},
+	{13000, KEY_UP, 100},      // Pid
+	{15000, KEY_BACK, 100},
+	{16000, KEY_DOWN, 100},    // Lcd
+	{17000, KEY_UP, 100},
+	{18000, KEY_SELECT, 100},  // Diag
+	{20000, KEY_BACK, 100},
+	{21000, KEY_DOWN, 100},    // Lcd
+	{22000, KEY_UP, 100},
+	{23000, KEY_SELECT, 100},  // Ramp
+	{25000, KEY_BACK, 100},
+	{26000, KEY_DOWN, 100},    // Lcd, then a long press that repeats
+	{27000, KEY_DOWN, 1500},
+	{29000, KEY_BACK, 100},
+};
+#define SCRIPT (sizeof(script) / sizeof(script[0]))
+
+typedef struct {
+	unsigned long count;
+	avr_cycle_count_t total, min, max;
+} stat_t;
+
+// Emulated sensor, replies to reads with the current temperature
+enum {AHT20, AM2320};
+typedef struct {
+	uint8_t type;
+	uint8_t addr;        // Write address
+	double temp, humid;  // Degrees and percent
+	uint8_t data[8], index, count;
+} sensor_t;
+
+// I2C bus with one sensor, the software bus also keeps its line state
+enum {IDLE, ADDRESS, WRITE, READ, READ_ACK};
+typedef struct {
+	sensor_t *dev;
+	bool selected;
+	avr_irq_t *twi_in;            // Replies on the TWI bus
+	avr_irq_t *sda_pin, *scl_pin; // Inputs of the software bus
+	bool sda, scl, drive;         // Master levels, sensor pulls SDA low
+	uint8_t state, bit, byte;
+	bool acked;
+} bus_t;
+
+typedef struct {
+	avr_irq_t *dc, *sce;
+	bool extended;
+	uint8_t x, y;
+	uint8_t screen[LCD_SIZE];
+	unsigned long bytes, frames;
+} lcd_t;
+
+static avr_t *avr;
+static avr_irq_t *zc_pin, *button[KEYS];
+static uint32_t zc_half;  // Half cycle in us
+static bool zc_high = false;
+static unsigned step = 0;
+static uint8_t probes = 0, view = HOME;
+static avr_cycle_count_t probe_start[PROBES];
+static stat_t section[PROBES], screen[VIEWS];
+static sensor_t sensors[2] = {
+	{.type = AHT20, .addr = 0x38 << 1, .temp = 20.0, .humid = 45},
+	{.type = AM2320, .addr = 0xB8, .temp = 19.5, .humid = 55},
+};
+static bus_t buses[2];
+static lcd_t lcd;
+
+static void stat_add(stat_t *s, avr_cycle_count_t cycles) {
+	if (!s->count || cycles < s->min) s->min = cycles;
+	if (cycles > s->max) s->max = cycles;
+	s->total += cycles;
+	s->count++;
+}
+
+// Zero-cross input, high for the pulse around each zero crossing
+static avr_cycle_count_t zc_edge(avr_t *avr, avr_cycle_count_t when, void *param) {
+	zc_high = !zc_high;
+	avr_raise_irq(zc_pin, zc_high);
+	return when + avr_usec_to_cycles(avr, zc_high ? ZC_PULSE : zc_half - ZC_PULSE);
+}
+
+static avr_cycle_count_t key_release(avr_t *avr, avr_cycle_count_t when, void *param) {
+	const press_t *p = param;
+	avr_raise_irq(button[p->key], 1);
+	return 0;
+}
+
+static avr_cycle_count_t key_press(avr_t *avr, avr_cycle_count_t when, void *param) {
+	const press_t *p = &script[step];
+	avr_raise_irq(button[p->key], 0);  // Active low
+	avr_cycle_timer_register_usec(avr, p->hold * 1000UL, key_release, (void *)p);
+	if (++step == SCRIPT) return 0;
+	return avr_usec_to_cycles(avr, script[step].ms * 1000UL);
+}
+
+static uint8_t crc8(const uint8_t *data, uint8_t len) {
+	uint8_t crc = 0xFF;
+	while (len--) {
+		crc ^= *data++;
+		for (uint8_t i = 0; i < 8; i++) crc = crc & 0x80 ? crc << 1 ^ 0x31 : crc << 1;
+	}
+	return crc;
+}
+
+static uint16_t crc16(const uint8_t *data, uint8_t len) {
+	uint16_t crc = 0xFFFF;
+	while (len--) {
+		crc ^= *data++;
+		for (uint8_t i = 0; i < 8; i++) crc = crc & 1 ? crc >> 1 ^ 0xA001 : crc >> 1;
+	}
+	return crc;
+}
+
+// Addressed by the master, a read returns a fresh measurement. The reading
+// drifts half a degree over ten minutes.
+static void sensor_start(sensor_t *s, bool read) {
+	s->index = 0;
+	if (!read) return;
+	double temp = s->temp + 0.5 * sin(2 * M_PI * avr_cycles_to_usec(avr, avr->cycle) / 600e6);
+	if (s->type == AHT20) {
+		uint32_t h = lround(s->humid / 100 * (1 << 20));
+		uint32_t t = lround((temp + 50) / 200 * (1 << 20));
+		s->data[0] = 0x18;  // Calibrated, not busy
+		s->data[1] = h >> 12;
+		s->data[2] = h >> 4;
+		s->data[3] = (h << 4 & 0xF0) | (t >> 16 & 0x0F);
+		s->data[4] = t >> 8;
+		s->data[5] = t;
+		s->data[6] = crc8(s->data, 6);
+		s->count = 7;
+	} else {
+		uint16_t h = lround(s->humid * 10);
+		int16_t t = lround(temp * 10);
+		uint16_t crc;
+		s->data[0] = 0x03;  // Function code and byte count
+		s->data[1] = 0x04;
+		s->data[2] = h >> 8;
+		s->data[3] = h;
+		s->data[4] = (abs(t) >> 8) | (t < 0 ? 0x80 : 0);
+		s->data[5] = abs(t);
+		crc = crc16(s->data, 6);
+		s->data[6] = crc;
+		s->data[7] = crc >> 8;
+		s->count = 8;
+	}
+}
+
+static uint8_t sensor_read(sensor_t *s) {
+	return s->index < s->count ? s->data[s->index++] : 0xFF;
+}
+
+// TWI messages from the master, answered with an ACK or a data byte
+static void twi_hook(avr_irq_t *irq, uint32_t value, void *param) {
+	bus_t *b = param;
+	avr_twi_msg_irq_t v;
+	v.u.v = value;
+	if (v.u.twi.msg & TWI_COND_STOP) b->selected = false;
+	if (v.u.twi.msg & TWI_COND_START) {
+		b->selected = (v.u.twi.addr & 0xFE) == b->dev->addr;
+		if (b->selected) {
+			sensor_start(b->dev, v.u.twi.addr & 1);
+			avr_raise_irq(b->twi_in, avr_twi_irq_msg(TWI_COND_ACK, v.u.twi.addr, 1));
+		}
+	}
+	if (!b->selected) return;
+	if (v.u.twi.msg & TWI_COND_WRITE)
+		avr_raise_irq(b->twi_in, avr_twi_irq_msg(TWI_COND_ACK, v.u.twi.addr, 1));
+	if (v.u.twi.msg & TWI_COND_READ)
+		avr_raise_irq(b->twi_in, avr_twi_irq_msg(TWI_COND_READ, v.u.twi.addr, sensor_read(b->dev)));
+}
+
+static void soft_load(bus_t *b) {
+	b->byte = sensor_read(b->dev);
+	b->bit = 0;
+	b->drive = !(b->byte & 0x80);
+}
+
+// Software I2C slave. The master drives a line low by making it an output, so
+// DDRD holds both line levels. The receiver samples on a rising SCL and the
+// transmitter changes SDA after a falling SCL.
+static void soft_hook(avr_irq_t *irq, uint32_t value, void *param) {
+	bus_t *b = param;
+	bool scl = !(value & 1 << SCL), sda = !(value & 1 << SDA);
+	if (scl && b->scl && sda != b->sda) {
+		// SDA falls for a start and rises for a stop while SCL is high
+		b->state = sda ? IDLE : ADDRESS;
+		b->selected = false;
+		b->bit = b->byte = 0;
+		b->drive = false;
+	} else if (scl && !b->scl) {
+		bool line = sda && !b->drive;
+		if ((b->state == ADDRESS || b->state == WRITE) && b->bit < 8) {
+			b->byte = b->byte << 1 | line;
+			b->bit++;
+		} else if (b->state == READ_ACK) {
+			b->acked = !line;
+		}
+	} else if (!scl && b->scl) {
+		switch (b->state) {
+			case ADDRESS:
+			case WRITE:
+				if (b->bit == 8) {
+					if (b->state == ADDRESS) {
+						b->selected = (b->byte & 0xFE) == b->dev->addr;
+						if (b->selected) sensor_start(b->dev, b->byte & 1);
+					}
+					b->drive = b->selected;  // Acknowledge
+					b->bit = 9;
+				} else if (b->bit == 9) {
+					b->drive = false;
+					if (!b->selected) {
+						b->state = IDLE;
+					} else if (b->state == ADDRESS && (b->byte & 1)) {
+						b->state = READ;
+						soft_load(b);
+					} else {
+						b->state = WRITE;
+						b->bit = b->byte = 0;
+					}
+				}
+				break;
+			case READ:
+				if (++b->bit == 8) {
+					b->drive = false;  // Master acknowledges
+					b->state = READ_ACK;
+				} else {
+					b->drive = !(b->byte & 0x80 >> b->bit);
+				}
+				break;
+			case READ_ACK:
+				if (b->acked) {
+					b->state = READ;
+					soft_load(b);
+				} else {
+					b->state = IDLE;
+				}
+		}
+	}
+	b->scl = scl;
+	b->sda = sda;
+	avr_raise_irq(b->scl_pin, scl);
+	avr_raise_irq(b->sda_pin, sda && !b->drive);
+}
+
+// PCD8544 in horizontal addressing mode, keeps the last frame
+static void lcd_hook(avr_irq_t *irq, uint32_t value, void *param) {
+	lcd_t *l = param;
+	if (l->sce->value) return;  // Chip enable is active low
+	l->bytes++;
+	if (l->dc->value) {
+		l->screen[l->y * 84 + l->x] = value;
+		if (++l->x == 84) {
+			l->x = 0;
+			if (++l->y == 6) {
+				l->y = 0;
+				l->frames++;
+			}
+		}
+	} else if ((value & 0xF8) == 0x20) {
+		l->extended = value & 1;
+	} else if (!l->extended) {
+		if (value & 0x80)
+			l->x = (value & 0x7F) % 84;
+		else if (value & 0x40)
+			l->y = (value & 0x07) % 6;
+	}
+}
+
+static void lcd_save(const lcd_t *l, const char *name) {
+	FILE *f = fopen(name, "w");
+	if (!f) return;
+	fprintf(f, "P1\n84 48\n");
+	for (uint8_t y = 0; y < 48; y++) {
+		for (uint8_t x = 0; x < 84; x++)
+			fputc(l->screen[y / 8 * 84 + x] & 1 << (y % 8) ? '1' : '0', f);
+		fputc('\n', f);
+	}
+	fclose(f);
+}
+
+// Times the sections between the rising and falling edge of each probe bit
+static void probe_hook(avr_irq_t *irq, uint32_t value, void *param) {
+	uint8_t changed = probes ^ value;
+	for (uint8_t i = 0; i < PROBES; i++) {
+		if (!(changed & 1 << i)) continue;
+		if (value & 1 << i) {
+			probe_start[i] = avr->cycle;
+			if (i == PROBE_RENDER) view = avr->data[GPIOR1_ADDR];
+		} else {
+			avr_cycle_count_t cycles = avr->cycle - probe_start[i];
+			stat_add(&section[i], cycles);
+			if (i == PROBE_RENDER && view < VIEWS) stat_add(&screen[view], cycles);
+		}
+	}
+	probes = value;
+}
+
+static void print_stat(const char *name, const stat_t *s, avr_cycle_count_t run) {
+	if (!s->count) {
+		printf("%-9s %7u\n", name, 0);
+		return;
+	}
+	printf("%-9s %7lu %8llu %8llu %8llu %6.2f\n", name, s->count, (unsigned long long)s->min,
+		(unsigned long long)(s->total / s->count), (unsigned long long)s->max, 100.0 * s->total / run);
+}
+
+int main(int argc, char *argv[]) {
+	uint32_t seconds = RUN, freq = 50;
+	bool swap = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:f:s")) != -1) {
+		switch (opt) {
+			case 't': seconds = atoi(optarg); break;
+			case 'f': freq = atoi(optarg); break;
+			case 's': swap = true; break;
+			default:
+				fprintf(stderr, "Usage: %s [-t seconds] [-f 50|60] [-s] firmware.elf\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc || !freq || !seconds) {
+		fprintf(stderr, "Usage: %s [-t seconds] [-f 50|60] [-s] firmware.elf\n", argv[0]);
+		return 1;
+	}
+	elf_firmware_t f;
+	memset(&f, 0, sizeof(f));
+	if (elf_read_firmware(argv[optind], &f)) {
+		fprintf(stderr, "Cannot read %s\n", argv[optind]);
+		return 1;
+	}
+	avr = avr_make_mcu_by_name(f.mmcu[0] ? f.mmcu : "atmega328p");
+	if (!avr) {
+		fprintf(stderr, "Unknown MCU %s\n", f.mmcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &f);  // Also starts the VCD trace of the firmware
+	if (!avr->frequency) avr->frequency = 8000000;
+
+	// Zero-cross pulses on ICP1, the first falling edge starts a half sine
+	zc_half = 500000 / freq;
+	zc_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0);
+	avr_cycle_timer_register_usec(avr, zc_half - ZC_PULSE / 2, zc_edge, NULL);
+
+	// Buttons, released until the script presses them
+	for (uint8_t i = 0; i < KEYS; i++) {
+		button[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), i);
+		avr_raise_irq(button[i], 1);
+	}
+	avr_cycle_timer_register_usec(avr, script[0].ms * 1000UL, key_press, NULL);
+
+	// Sensors, bus 0 is the TWI hardware and bus 1 the software I2C
+	buses[0].dev = &sensors[swap ? 1 : 0];
+	buses[1].dev = &sensors[swap ? 0 : 1];
+	buses[0].twi_in = avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ('0'), TWI_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ('0'), TWI_IRQ_OUTPUT), twi_hook, &buses[0]);
+	bus_t *b = &buses[1];
+	b->sda = b->scl = true;
+	b->sda_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), SDA);
+	b->scl_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), SCL);
+	avr_raise_irq(b->sda_pin, 1);
+	avr_raise_irq(b->scl_pin, 1);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_DIRECTION_ALL), soft_hook, b);
+
+	// LCD
+	lcd.dc = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), LCD_DC);
+	lcd.sce = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), LCD_SCE);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ('0'), SPI_IRQ_OUTPUT), lcd_hook, &lcd);
+
+	// Probes
+	avr_irq_register_notify(avr_iomem_getirq(avr, GPIOR0_ADDR, "probes", AVR_IOMEM_IRQ_ALL), probe_hook, NULL);
+
+	avr_cycle_count_t run = avr_usec_to_cycles(avr, seconds * 1000000UL);
+	int state = cpu_Running;
+	while (avr->cycle < run && state != cpu_Done && state != cpu_Crashed) state = avr_run(avr);
+	if (state == cpu_Crashed) printf("Firmware crashed at cycle %llu\n", (unsigned long long)avr->cycle);
+	run = avr->cycle;
+
+	printf("Firmware cycles under simavr, %u s at %u Hz, %u Hz mains, %s on TWI\n",
+		seconds, avr->frequency, freq, swap ? "AM2320" : "AHT20");
+	printf("Section     Count      Min      Avg      Max  CPU %%\n");
+	for (uint8_t i = 0; i < PROBES; i++) print_stat(probe_names[i], &section[i], run);
+	printf("\nRender per screen\n");
+	for (uint8_t i = 0; i < VIEWS; i++) print_stat(view_names[i], &screen[i], run);
+	printf("\nLCD %lu bytes, %lu frames, last frame in lcd.pbm\n", lcd.bytes, lcd.frames);
+	lcd_save(&lcd, "lcd.pbm");
+	avr_terminate(avr);
+	return state == cpu_Crashed;
+}
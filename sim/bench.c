@@ -0,0 +1,164 @@
+/*
+ * Control benchmark
+ *
+ * Runs channel 0 of the control module in closed loop with the thermal plant,
+ * one control step every dT seconds like the main loop, and reports settling
+ * time, overshoot, steady-state error, output changes and host time per
+ * control step for a set of scenarios, on a first and a second order plant.
+ * The transition scenarios compare a plain setpoint step with the ramp,
+ * feed-forward and warm-up gains. The adaptive scenarios lengthen the sample
+ * interval of a steady channel like the main loop, so pid() runs with a
+ * varying elapsed time. The host time only compares scenarios with
+ * each other, avr_bench reports the cycles on the ATmega328P.
+ *
+ * Created: 18/10/2026 16:09:52
+ */ 
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "plant.h"
+#include "../control.h"
+
+#define DT 2               // Seconds between control steps
+#define SETTLE (4 * 3600)  // Seconds before the setpoint step
+#define RUN (4 * 3600)     // Seconds measured after the setpoint step
+#define BAND 0.3           // Settled within this many degrees
+
+typedef struct {
+	const char *name;
+	bool on_off;
+	uint8_t hyst, window;
+	uint8_t Kp, Ki;
+	uint16_t Kd;
+	int16_t from, to;  // Setpoint before and after the step in tenths
+	uint8_t ramp, Kf, wKp, wKi;
+	uint16_t wKd;
+	bool adapt;  // Sample interval set by control_interval instead of fixed at dT
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+	{"Dimming PID",         false, 0, 0, 90, 10, 10, 150, 200, 0, 0, 0, 0, 0, false},
+	{"On/off hysteresis",   true,  5, 0, 90, 10, 10, 150, 200, 0, 0, 0, 0, 0, false},
+	{"On/off window 60 s",  true,  5, 6, 90, 10, 10, 150, 200, 0, 0, 0, 0, 0, false},
+	{"Dimming PID, +3.0",   false, 0, 0, 90, 10, 10, 200, 230, 0, 0, 0, 0, 0, false},
+	{"Dimming PID, -3.0",   false, 0, 0, 90, 10, 10, 230, 200, 0, 0, 0, 0, 0, false},
+	{"Adaptive interval",   false, 0, 0, 90, 10, 10, 150, 200, 0, 0, 0, 0, 0, true},
+	{"Adaptive, window",    true,  5, 6, 90, 10, 10, 150, 200, 0, 0, 0, 0, 0, true},
+};
+
+// Feed-forward of 33 hundredths of a dim step per tenth of a degree matches the
+// plant gain of 0.3 degrees per dim step
+static const scenario_t transitions[] = {
+	{"Step",                false, 0, 0, 90, 10, 10, 200, 230, 0, 0, 0, 0, 0, false},
+	{"Ramp 1.0/min",        false, 0, 0, 90, 10, 10, 200, 230, 10, 0, 0, 0, 0, false},
+	{"Ramp 0.2/min",        false, 0, 0, 90, 10, 10, 200, 230, 2, 0, 0, 0, 0, false},
+	{"Feed-forward",        false, 0, 0, 90, 10, 10, 200, 230, 0, 33, 0, 0, 0, false},
+	{"Warm-up gains",       false, 0, 0, 90, 10, 10, 200, 230, 0, 0, 150, 30, 20, false},
+	{"Feed-forward + ramp", false, 0, 0, 90, 10, 10, 200, 230, 2, 33, 0, 0, 0, false},
+	{"All",                 false, 0, 0, 90, 10, 10, 200, 230, 2, 33, 150, 30, 20, false},
+};
+
+static const plant_t room = {
+	.gain = 0.3,     // 15 degrees rise at full power
+	.tau = 600,
+	.dead = 30,
+	.ambient = 15,
+	.noise = 0.05,
+};
+
+// The same room heated through a radiator with a time constant of a minute
+static const plant_t radiator = {
+	.gain = 0.3,
+	.tau = 600,
+	.tau2 = 60,
+	.dead = 30,
+	.ambient = 15,
+	.noise = 0.05,
+};
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const scenario_t *s, const plant_t *model) {
+	static plant_t plant;
+	plant = *model;
+	plant_init(&plant, model->ambient);
+	memset(control, 0, sizeof(control));
+	profile_t *p = &profile[0];
+	*p = (profile_t){.base_temp = s->from, .Kp = s->Kp, .Ki = s->Ki, .Kd = s->Kd,
+		.hyst = s->hyst, .window = s->window, .automatic = true, .on_off = s->on_off,
+		.ramp = s->ramp, .Kf = s->Kf, .wKp = s->wKp, .wKi = s->wKi, .wKd = s->wKd};
+	tune = 0;
+	double worst = 0, error = 0, cost = 0;
+	uint32_t settled = 0, changes = 0, steps = 0, tail = 0;
+	uint8_t last_dim = 0, interval = DT;
+	uint32_t next = 0, last = 0;
+	for (uint32_t t = 0; t < SETTLE + RUN; t++) {
+		bool measure = t >= SETTLE;
+		if (t == SETTLE) p->base_temp = s->to;
+		if (t == next) {
+			uint16_t elapsed = t ? (t - last) * 256 : DT * 256;
+			int16_t input = plant_read(&plant);
+			double start = now_ns();
+			int16_t setpoint = control_setpoint(0, p->base_temp, input, elapsed);
+			uint8_t output = pid(0, input, setpoint, elapsed, DT * 256);
+			control_output(0, output, input, setpoint, elapsed);
+			if (s->adapt) interval = control_interval(interval, DT, control_steady(0, input, setpoint));
+			last = t;
+			next = t + interval;
+			if (measure) {
+				cost += now_ns() - start;
+				steps++;
+			}
+		}
+		control_tick(1);
+		plant_step(&plant, p->dim);
+		if (!measure) continue;
+		if (p->dim != last_dim) changes++;
+		last_dim = p->dim;
+		double deviation = plant.temp - s->to / 10.0;
+		double over = s->to > s->from ? deviation : -deviation;
+		if (over > worst) worst = over;
+		if (deviation > BAND || deviation < -BAND) settled = t - SETTLE + 1;
+		if (t >= SETTLE + RUN - 3600) {
+			error += deviation;
+			tail++;
+		}
+	}
+	printf("%-22s", s->name);
+	if (settled < RUN) printf("%8.1f", settled / 60.0); else printf("%8s", "-");
+	printf("%11.2f%10.2f%9u%7u%9.0f\n", worst, error / tail, changes, steps, cost / steps);
+}
+
+static void header(const char *title) {
+	printf("%-22s%8s%11s%10s%9s%7s%9s\n", title, "Settle", "Overshoot", "SS error", "Changes", "Steps", "Host ns");
+	printf("%-22s%8s%11s%10s%9s%7s%9s\n", "", "min", "deg", "deg", "", "", "per step");
+}
+
+static void plant_info(const char *name, const plant_t *p) {
+	double tu, ku = plant_ku(p, &tu);
+	printf("%s: gain %.2f/step, tau %.0f s", name, p->gain, p->tau);
+	if (p->tau2 > 0) printf(" and %.0f s", p->tau2);
+	printf(", dead time %u s, noise %.2f, Ku %.1f steps/deg, Tu %.0f s\n", p->dead, p->noise, ku, tu);
+}
+
+int main(void) {
+	plant_info("First order plant", &room);
+	plant_info("Second order plant", &radiator);
+	printf("Step at %u h, measured for %u h, dT %u s, settled within %.1f deg\n", SETTLE / 3600, RUN / 3600, DT, BAND);
+	printf("Host ns per step is measured on this machine and does not represent the\n"
+		"ATmega328P, make cycles reports AVR cycles per control step\n\n");
+	header("First order plant");
+	for (uint8_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) run(&scenarios[i], &room);
+	printf("\n");
+	header("Second order plant");
+	for (uint8_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) run(&scenarios[i], &radiator);
+	printf("\n");
+	header("Transition 20.0 to 23.0");
+	for (uint8_t i = 0; i < sizeof(transitions) / sizeof(transitions[0]); i++) run(&transitions[i], &room);
+	return 0;
+}
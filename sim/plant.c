@@ -0,0 +1,62 @@
+/*
+ * Thermal plant
+ *
+ * Created: 18/10/2026 16:04:31
+ */ 
+
+#include <math.h>
+#include <string.h>
+#include "plant.h"
+
+// Starts the plant in equilibrium at a temperature, with the heating off
+void plant_init(plant_t *p, double temp) {
+	p->temp = p->heater = temp;
+	memset(p->delay, 0, sizeof(p->delay));
+	p->head = 0;
+	p->seed = 12345;
+}
+
+// Advances the plant by one second. Heating power is taken proportional to the
+// dim level, which is the time average for on/off and time proportioned
+// channels. Each lag is integrated exactly over the second.
+void plant_step(plant_t *p, uint8_t dim) {
+	uint16_t tail = (p->head + PLANT_DELAY - p->dead) % PLANT_DELAY;
+	p->delay[p->head] = dim;
+	uint8_t u = p->dead ? p->delay[tail] : dim;
+	p->head = (p->head + 1) % PLANT_DELAY;
+	double target = p->ambient + p->gain * u;
+	if (p->tau2 > 0) {
+		p->heater += (target - p->heater) * (1 - exp(-1 / p->tau2));
+		target = p->heater;
+	}
+	p->temp += (target - p->temp) * (1 - exp(-1 / p->tau));
+}
+
+// Uniform random number in (0, 1) from a fixed seed, so runs repeat exactly
+static double plant_random(plant_t *p) {
+	p->seed = p->seed * 1103515245 + 12345;
+	return ((p->seed >> 8) + 0.5) / 16777216.0;
+}
+
+// Returns the sensor reading in tenths of a degree
+int16_t plant_read(plant_t *p) {
+	double n = 0;
+	if (p->noise > 0) {  // Box-Muller
+		double r = sqrt(-2 * log(plant_random(p)));
+		n = p->noise * r * cos(2 * M_PI * plant_random(p));
+	}
+	return (int16_t)lround((p->temp + n) * 10);
+}
+
+// Returns the ultimate gain in dim steps per degree and the ultimate period in
+// seconds of the loop around the plant, where the phase lag of the time
+// constants and the dead time add up to 180 degrees.
+double plant_ku(const plant_t *p, double *tu) {
+	double lo = 0, hi = M_PI / p->dead;
+	for (uint8_t i = 0; i < 60; i++) {
+		double w = (lo + hi) / 2;
+		if (w * p->dead + atan(w * p->tau) + atan(w * p->tau2) < M_PI) lo = w; else hi = w;
+	}
+	*tu = 2 * M_PI / lo;
+	return sqrt(1 + lo * p->tau * lo * p->tau) * sqrt(1 + lo * p->tau2 * lo * p->tau2) / p->gain;
+}
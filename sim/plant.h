@@ -0,0 +1,40 @@
+/*
+ * Thermal plant
+ *
+ * Host model of a heated space for the control benchmarks and tests: a first
+ * or second order lag with dead time, driven by the dim level of a channel,
+ * read through a noisy sensor that reports tenths of a degree like the AHT20
+ * and AM2320. The second lag stands for the heater itself, which has to warm
+ * up before the space does.
+ *
+ * Created: 18/10/2026 16:04:12
+ */ 
+
+
+#ifndef PLANT_H_
+#define PLANT_H_
+
+#include <stdint.h>
+
+#define PLANT_DELAY 1024  // Longest dead time in seconds
+
+typedef struct {
+	double gain;     // Steady state rise in degrees per dim step
+	double tau;      // Time constant in seconds
+	double tau2;     // Time constant of the second lag in seconds, zero for first order
+	uint16_t dead;   // Dead time in seconds
+	double ambient;  // Temperature without heating in degrees
+	double noise;    // Standard deviation of the sensor noise in degrees
+	double temp;     // True temperature in degrees
+	double heater;   // Output of the second lag in degrees
+	uint8_t delay[PLANT_DELAY];  // Dim levels of the last seconds
+	uint16_t head;
+	uint32_t seed;
+} plant_t;
+
+extern void plant_init(plant_t *p, double temp);
+extern void plant_step(plant_t *p, uint8_t dim);
+extern int16_t plant_read(plant_t *p);
+extern double plant_ku(const plant_t *p, double *tu);
+
+#endif /* PLANT_H_ */
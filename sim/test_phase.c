@@ -0,0 +1,160 @@
+/*
+ * Phase control timing test
+ *
+ * Replays the zero-cross edges of 50 and 60 Hz mains through the Timer1
+ * capture logic, with edge jitter, unequal half waves and different pulse
+ * widths, and reports per dim level the firing angle error against the ideal
+ * angle between the true zero crossings and the gate width. The firing angle
+ * is scaled to the half sine without the zero-cross pulse, so the error has an
+ * offset of up to a pulse width at the low levels; jitter and asymmetry show
+ * as the spread. The checks are that no gate runs into the next half cycle,
+ * that no gate is too short to trigger and that the stagger keeps the average
+ * angle of both half waves and the gate ends unchanged.
+ *
+ * Created: 18/10/2026 16:24:05
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../phase.h"
+
+#define HALVES 2000     // Half cycles replayed per case
+#define START 60000.0   // First zero crossing in us, so the counter wraps early
+#define GATE_MIN 100    // Shortest gate in Timer1 ticks that still triggers
+#define STAGGER 3
+
+typedef struct {
+	const char *name;
+	double freq;    // Mains frequency in Hz
+	double pulse;   // Zero-cross pulse width in us
+	double jitter;  // Largest edge displacement in us
+	double asym;    // Positive half wave minus negative half wave in us
+} case_t;
+
+static const case_t cases[] = {
+	{"50 Hz", 50, 600, 0, 0},
+	{"60 Hz", 60, 600, 0, 0},
+	{"jitter", 50, 600, 20, 0},
+	{"asym", 50, 600, 0, 200},
+	{"wide", 50, 1000, 0, 0},
+	{"60 Hz all", 60, 1000, 20, 200},
+};
+#define CASES (sizeof(cases) / sizeof(cases[0]))
+
+typedef struct {
+	int16_t err_min, err_max;   // Firing angle error in us
+	uint16_t gate_min, gate_max;
+	int16_t tail;               // Largest gate end minus the next zero crossing
+} level_t;
+
+static level_t levels[CASES][DIM_STEPS + 1];
+static unsigned failures = 0;
+
+// Zero crossing k of a case, the odd crossings are moved by the asymmetry
+static double crossing(const case_t *c, long k) {
+	return START + k * 5e5 / c->freq + (k & 1 ? c->asym / 2 : 0);
+}
+
+// Edge captured at t us with jitter, Timer1 runs at 1 us per tick
+static uint16_t capture(const case_t *c, double t) {
+	if (c->jitter) t += c->jitter * (2.0 * rand() / RAND_MAX - 1);
+	return (uint16_t)llround(t);
+}
+
+static void fail(const char *name, const char *what, unsigned dim) {
+	if (failures++ < 20) printf("FAIL %s: %s at dim %u\n", name, what, dim);
+}
+
+// Replays the edges of one case in the order of the capture ISR and plans
+// every level of channel 0 for each half cycle
+static void run(const case_t *c, level_t *lv) {
+	uint16_t last_rise, fall, rise, half_zero;
+	for (uint8_t d = 1; d <= DIM_STEPS; d++) lv[d] = (level_t){INT16_MAX, INT16_MIN, UINT16_MAX, 0, INT16_MIN};
+	last_rise = capture(c, crossing(c, 1) - c->pulse / 2);
+	for (long k = 1; k <= HALVES; k++) {
+		// Negative edge at the begin of half sine k, positive edge at its end
+		fall = capture(c, crossing(c, k) + c->pulse / 2);
+		half_zero = (uint16_t)(fall - last_rise) / 2;
+		rise = capture(c, crossing(c, k + 1) - c->pulse / 2);
+		last_rise = rise;
+		// The plan is for the half cycle between crossings k + 1 and k + 2
+		double start = crossing(c, k + 1), end = crossing(c, k + 2);
+		for (uint8_t d = 1; d <= DIM_STEPS; d++) {
+			firing_t f;
+			phase_plan(&f, rise, fall, half_zero, d, 0, 0, false);
+			uint16_t ideal = (uint16_t)llround(start + (end - start) * (DIM_STEPS - d) / DIM_STEPS);
+			int16_t err = f.fire[0] - ideal;
+			int16_t tail = f.fire[0] + f.gate[0] - (uint16_t)llround(end);
+			level_t *l = &lv[d];
+			if (err < l->err_min) l->err_min = err;
+			if (err > l->err_max) l->err_max = err;
+			if (f.gate[0] < l->gate_min) l->gate_min = f.gate[0];
+			if (f.gate[0] > l->gate_max) l->gate_max = f.gate[0];
+			if (tail > l->tail) l->tail = tail;
+		}
+	}
+	for (uint8_t d = 1; d <= DIM_STEPS; d++) {
+		if (lv[d].tail >= 0) fail(c->name, "gate runs into the next half cycle", d);
+		if (lv[d].gate_min < GATE_MIN) fail(c->name, "gate too short", d);
+	}
+}
+
+// Two channels a step apart are spread by the stagger. Over four half cycles
+// each channel has to fire early and late on both half waves, so the average
+// angle of the positive and the negative half waves is the same.
+static void stagger(const case_t *c) {
+	uint16_t last_rise = capture(c, crossing(c, 1) - c->pulse / 2);
+	uint8_t halves = 0;
+	double sum[CHANNELS][2] = {{0}};
+	uint8_t dim[CHANNELS] = {20, 21};
+	for (long k = 1; k <= HALVES; k++) {
+		uint16_t fall = capture(c, crossing(c, k) + c->pulse / 2);
+		uint16_t half_zero = (uint16_t)(fall - last_rise) / 2;
+		uint16_t rise = capture(c, crossing(c, k + 1) - c->pulse / 2);
+		last_rise = rise;
+		firing_t f, ideal;
+		halves++;
+		phase_plan(&f, rise, fall, half_zero, dim[0], dim[1], STAGGER, halves & 2);
+		phase_plan(&ideal, rise, fall, half_zero, dim[0], dim[1], 0, false);
+		for (uint8_t i = 0; i < CHANNELS; i++) {
+			sum[i][k & 1] += (int16_t)(f.fire[i] - ideal.fire[i]);
+			if ((uint16_t)(f.fire[i] + f.gate[i]) != (uint16_t)(ideal.fire[i] + ideal.gate[i])) fail(c->name, "stagger moves the gate end", dim[i]);
+		}
+	}
+	for (uint8_t i = 0; i < CHANNELS; i++) {
+		double dc = (sum[i][1] - sum[i][0]) / (HALVES / 2);
+		printf("Stagger %u on %s, channel %u: average angle of the half waves differs %.1f us\n",
+			STAGGER, c->name, i + 1, dc);
+		if (fabs(dc) > 1) fail(c->name, "stagger fires one half wave early", dim[i]);
+	}
+}
+
+int main(void) {
+	uint8_t i, d;
+	srand(1);
+	for (i = 0; i < CASES; i++) run(&cases[i], levels[i]);
+	printf("Firing angle error in us (min/max) per dim level\nLevel");
+	for (i = 0; i < CASES; i++) printf(" %12s", cases[i].name);
+	for (d = 1; d <= DIM_STEPS; d++) {
+		printf("\n%5u", d);
+		for (i = 0; i < CASES; i++) printf("  %5d/%5d", levels[i][d].err_min, levels[i][d].err_max);
+	}
+	printf("\n\nGate width in us (min/max) per dim level\nLevel");
+	for (i = 0; i < CASES; i++) printf(" %12s", cases[i].name);
+	for (d = 1; d <= DIM_STEPS; d++) {
+		printf("\n%5u", d);
+		for (i = 0; i < CASES; i++) printf("  %5u/%5u", levels[i][d].gate_min, levels[i][d].gate_max);
+	}
+	printf("\n\nGate end minus next zero crossing in us, largest below full on and at full on\n     ");
+	for (i = 0; i < CASES; i++) {
+		int16_t tail = INT16_MIN;
+		for (d = 1; d < DIM_STEPS; d++) if (levels[i][d].tail > tail) tail = levels[i][d].tail;
+		printf("  %5d/%5d", tail, levels[i][DIM_STEPS].tail);
+	}
+	printf("\n\n");
+	stagger(&cases[0]);
+	stagger(&cases[5]);
+	printf("%u failures\n", failures);
+	return failures != 0;
+}
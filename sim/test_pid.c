@@ -0,0 +1,109 @@
+/*
+ * PID unit test
+ *
+ * Checks pid() against a double precision PID with the same structure:
+ * integral and proportional on measurement terms in one accumulator that is
+ * clamped to the output range, and derivative on measurement. The reference is
+ * resynchronized to the accumulator every step, so each step is checked on its
+ * own for inputs and setpoints over -40.0 to 80.0 degrees, all gains and
+ * interval ratios.
+ *
+ * Created: 18/10/2026 16:15:08
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../control.h"
+
+#define MAX_OUT (DIM_STEPS * 100.0)  // Output range in hundredths of a dim step
+
+static unsigned failures = 0, checks = 0;
+
+#define check(cond, ...) do { \
+	checks++; \
+	if (!(cond)) { \
+		failures++; \
+		if (failures <= 20) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } \
+	} \
+} while (0)
+
+static double clamp(double x, double lo, double hi) {
+	return x < lo ? lo : x > hi ? hi : x;
+}
+
+// One step of the reference in hundredths of a dim step, returns the output
+// before rounding and updates the accumulator
+static double reference(double *sum, double last, int input, int setpoint, int kp, int ki, int kd,
+		unsigned elapsed, unsigned nominal) {
+	double error = clamp(setpoint - input, -2000, 2000);
+	double dInput = clamp(input - last, -2000, 2000);
+	double ratio = clamp(elapsed * 256.0 / nominal, 64, 1024) / 256;  // Interval in nominal intervals
+	*sum += 0.2 * ki * error * ratio - kp * dInput;
+	*sum = clamp(*sum, 0, MAX_OUT);
+	return clamp(*sum - kd * dInput * 0.5 / ratio, 0, MAX_OUT);
+}
+
+// Runs one step of both and compares them. Integer truncation of the integral
+// and derivative terms may differ by less than a hundredth each.
+static void step(int input, int setpoint, int kp, int ki, int kd, unsigned elapsed, unsigned nominal) {
+	profile[0].Kp = kp;
+	profile[0].Ki = ki;
+	profile[0].Kd = kd;
+	double sum = control[0].outputSum;
+	double ref = reference(&sum, control[0].lastInput, input, setpoint, kp, ki, kd, elapsed, nominal);
+	uint8_t out = pid(0, input, setpoint, elapsed, nominal);
+	check(fabs(control[0].outputSum - sum) <= 1, "sum %ld, reference %.2f (in %d sp %d K %d/%d/%d dt %u/%u)",
+		(long)control[0].outputSum, sum, input, setpoint, kp, ki, kd, elapsed, nominal);
+	int lo = floor((ref - 2 + 50) / 100), hi = floor((ref + 2 + 50) / 100);
+	check(out >= lo && out <= hi, "output %u, reference %.2f (in %d sp %d K %d/%d/%d dt %u/%u)",
+		out, ref / 100, input, setpoint, kp, ki, kd, elapsed, nominal);
+	check(control[0].outputSum >= 0 && control[0].outputSum <= MAX_OUT, "sum %ld out of range", (long)control[0].outputSum);
+}
+
+static int random_range(int lo, int hi) {
+	return lo + rand() % (hi - lo + 1);
+}
+
+int main(void) {
+	static const int temps[] = {-400, -1, 0, 1, 800};
+	static const int gains[] = {0, 1, 2, 3, 127, 128, 254, 255};
+	static const int kd_gains[] = {0, 1, 255, 256, 257, 4096, KD_MAX - 1, KD_MAX};
+	static const unsigned ratios[] = {16, 64, 255, 256, 257, 1024, 4096};  // Elapsed per 256 nominal
+	srand(1);
+	// Random steps over the whole range
+	for (unsigned long i = 0; i < 1000000; i++) {
+		unsigned nominal = random_range(1, 59) * 256;
+		unsigned long elapsed = (unsigned long)nominal * random_range(16, 1280) / 256;
+		control[0].lastInput = random_range(-400, 800);
+		control[0].outputSum = random_range(0, MAX_OUT);
+		step(random_range(-400, 800), random_range(-400, 800), random_range(0, 255), random_range(0, 255),
+			random_range(0, KD_MAX), elapsed > UINT16_MAX ? UINT16_MAX : elapsed, nominal);
+	}
+	// Extremes of temperature, gains and interval, including odd Kd
+	for (unsigned a = 0; a < 5; a++)
+		for (unsigned b = 0; b < 5; b++)
+			for (unsigned c = 0; c < 5; c++)
+				for (unsigned k = 0; k < 8; k++)
+					for (unsigned d = 0; d < 8; d++)
+						for (unsigned r = 0; r < 7; r++)
+							for (long s = 0; s <= MAX_OUT; s += MAX_OUT / 2) {
+								control[0].lastInput = temps[c];
+								control[0].outputSum = s;
+								step(temps[a], temps[b], gains[k], gains[(k + 3) % 8], kd_gains[d],
+									ratios[r] * 10UL, 2560);
+							}
+	// Saturation and anti-windup: a long full output must not wind up the
+	// accumulator, so the output leaves the limit in the step the error reverses
+	control[0].lastInput = 200;
+	control[0].outputSum = 0;
+	for (unsigned i = 0; i < 5000; i++) step(200, 800, 90, 10, 11, 512, 512);
+	check(control[0].outputSum == MAX_OUT, "sum %ld after positive saturation", (long)control[0].outputSum);
+	step(200, 150, 90, 10, 11, 512, 512);
+	check(pid(0, 200, 150, 512, 512) < DIM_STEPS, "output stays at the limit after the error reversed");
+	for (unsigned i = 0; i < 5000; i++) step(200, -400, 90, 10, 11, 512, 512);
+	check(control[0].outputSum == 0, "sum %ld after negative saturation", (long)control[0].outputSum);
+	check(pid(0, 200, 250, 512, 512) > 0, "output stays off after the error reversed");
+	printf("%u checks, %u failures\n", checks, failures);
+	return failures != 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Auto-tune test
+ *
+ * Runs the relay auto-tune on the thermal plant and checks the gains against
+ * the Ziegler-Nichols gains from the known ultimate gain Ku and period Tu of
+ * the plant. The relay method estimates Ku and Tu from the describing
+ * function of the relay, which assumes a sinusoidal oscillation. On lag
+ * dominated plants the oscillation is closer to a triangle, so Ku comes out
+ * low, by 19% in the limit, and the relay hysteresis and the sample interval
+ * lower it further and lengthen Tu. The checks allow for that, and also check
+ * that Ki and Kd follow from Kp and the measured period without clamping and
+ * that an on/off channel keeps its minimum on and off times.
+ *
+ * Created: 18/10/2026 16:18:44
+ */ 
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include "plant.h"
+#include "../control.h"
+
+#define DT 2        // Seconds between control steps
+#define KU_LOW 0.6   // Lowest allowed ratio of the estimated to the true Ku
+#define KU_HIGH 1.05 // Highest allowed ratio, a high Ku would make the loop unstable
+#define TU_MARGIN 0.25  // Allowed relative error of Tu
+
+extern uint16_t tune_period;  // Samples of TUNE_CYCLES periods, kept after the tune
+
+static unsigned failures = 0;
+
+// Tunes channel 0 around the middle of the plant range, where the relay is
+// symmetric, and compares the result with the Ku and Tu of the plant. An
+// on/off channel is switched at most once per min_on or min_off period.
+static void run(const char *name, plant_t *plant, bool on_off, uint8_t min_time) {
+	double tu, ku = plant_ku(plant, &tu);
+	int16_t setpoint = lround((plant->ambient + plant->gain * DIM_STEPS / 2) * 10);
+	plant_init(plant, setpoint / 10.0);
+	memset(control, 0, sizeof(control));
+	profile[0] = (profile_t){.base_temp = setpoint, .automatic = true, .on_off = on_off,
+		.min_on = min_time, .min_off = min_time};
+	tune_start(1);
+	uint32_t t, last_switch = 0, shortest = UINT32_MAX;
+	uint8_t switches = 0;
+	for (t = 0; tune && t < 24 * 3600UL; t++) {
+		if (t % DT == 0) {
+			uint8_t dim = autotune(plant_read(plant), setpoint, DT * 256);
+			if (dim != profile[0].dim && switches++) {
+				if (t - last_switch < shortest) shortest = t - last_switch;
+			}
+			if (dim != profile[0].dim) last_switch = t;
+			profile[0].dim = dim;
+		}
+		plant_step(plant, profile[0].dim);
+	}
+	const profile_t *p = &profile[0];
+	uint16_t samples = tune_period / TUNE_CYCLES;
+	// Ziegler-Nichols gains in units of pid(), see tune_finish
+	double kp = 0.6 * ku * 10, ki = kp * 10 / (tu / DT), kd = kp * (tu / DT) / 4;
+	printf("%-6s Ku %5.1f Tu %4.0f s, tuned Kp %3u (%5.1f) Tu %4u s, Ki %3u (%5.1f) Kd %4u (%6.1f)",
+		name, ku, tu, p->Kp, kp, samples * DT, p->Ki, ki, p->Kd, kd);
+	if (on_off) printf(", shortest switch %u s", shortest);
+	printf("\n");
+	bool ok = !tune;
+	if (on_off) {
+		ok = ok && shortest >= min_time * 10U;
+	} else {
+		ok = ok && p->Kp >= KU_LOW * kp && p->Kp <= KU_HIGH * kp && fabs(samples * DT - tu) <= TU_MARGIN * tu;
+		// The margins of Kp and Tu carry over to Ki = Kp / Tu and Kd = Kp * Tu
+		ok = ok && p->Ki >= KU_LOW / (1 + TU_MARGIN) * ki && p->Ki <= KU_HIGH / (1 - TU_MARGIN) * ki;
+		ok = ok && p->Kd >= KU_LOW * (1 - TU_MARGIN) * kd && p->Kd <= KU_HIGH * (1 + TU_MARGIN) * kd;
+	}
+	// Ki = 10 * Kp / Tu and Kd = Kp * Tu / 4 with Tu in samples, unclamped
+	ok = ok && p->Ki == (p->Kp * 10 + samples / 2) / samples;
+	ok = ok && p->Kd == p->Kp * samples / 4;
+	if (!ok) {
+		printf("FAIL %s\n", name);
+		failures++;
+	}
+}
+
+int main(void) {
+	plant_t plants[] = {
+		{.gain = 0.6, .tau = 200, .dead = 30, .ambient = 20, .noise = 0.02},
+		{.gain = 0.4, .tau = 100, .dead = 30, .ambient = 20, .noise = 0.02},
+		{.gain = 0.8, .tau = 300, .dead = 40, .ambient = 15, .noise = 0.05},
+		{.gain = 0.4, .tau = 900, .dead = 90, .ambient = 15, .noise = 0.05},
+		{.gain = 0.6, .tau = 200, .tau2 = 60, .dead = 30, .ambient = 20, .noise = 0.02},
+	};
+	for (uint8_t i = 0; i < 5; i++) {
+		char name[8];
+		sprintf(name, "P%u", i);
+		run(name, &plants[i], false, 0);
+	}
+	// On/off channel with a minimum on and off time of 90 s, longer than the
+	// half periods of the relay, so the lockout sets the period
+	run("P0 on", &plants[0], true, 9);
+	// A manual channel keeps its output level
+	profile[1] = (profile_t){.automatic = false, .dim = 20};
+	tune_start(2);
+	if (tune) {
+		printf("FAIL tune started on a manual channel\n");
+		failures++;
+	}
+	printf("%u failures\n", failures);
+	return failures != 0;
+}